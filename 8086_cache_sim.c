@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Set-associative cache model driven by a recorded memory trace. A TLB is the
+// same model with the page size as its line size.
+
+enum CachePolicy
+{
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+};
+
+const char *cache_policy_names[3] = {"lru", "fifo", "random"};
+
+struct CacheConfig
+{
+    const char *name;
+    bool tlb;
+    u_int32_t size;
+    u_int32_t ways;
+    u_int32_t line_size;
+    int policy;
+};
+
+struct CacheSim
+{
+    struct CacheConfig config;
+    u_int32_t set_count;
+
+    u_int32_t *tags;
+    u_int64_t *stamps;
+    bool *valid;
+
+    u_int64_t clock;
+    u_int32_t random_state;
+
+    u_int64_t hits;
+    u_int64_t misses;
+    u_int64_t evictions;
+};
+
+// Parses SIZE:WAYS:LINE[:POLICY] for caches, e.g. "1024:2:64:lru", and
+// ENTRIES:WAYS:PAGE[:POLICY] for TLBs.
+bool parse_cache_config(const char *text, const char *name, bool tlb, struct CacheConfig *config)
+{
+    char policy[16] = "lru";
+    config->name = name;
+    config->tlb = tlb;
+    if (sscanf(text, "%u:%u:%u:%15s", &config->size, &config->ways, &config->line_size, policy) < 3)
+    {
+        return false;
+    }
+    if (config->line_size == 0)
+    {
+        return false;
+    }
+    if (tlb)
+    {
+        if (config->size > UINT32_MAX / config->line_size)
+        {
+            return false;
+        }
+        config->size *= config->line_size;
+    }
+
+    config->policy = -1;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (strcmp(policy, cache_policy_names[i]) == 0)
+        {
+            config->policy = i;
+        }
+    }
+
+    return config->policy >= 0 && config->ways > 0 && (config->line_size & (config->line_size - 1)) == 0 &&
+           config->size >= (u_int64_t)config->ways * config->line_size;
+}
+
+void init_cache(struct CacheSim *cache, struct CacheConfig config)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->config = config;
+    cache->set_count = config.size / (config.ways * config.line_size);
+    cache->tags = calloc(cache->set_count * config.ways, sizeof(u_int32_t));
+    cache->stamps = calloc(cache->set_count * config.ways, sizeof(u_int64_t));
+    cache->valid = calloc(cache->set_count * config.ways, sizeof(bool));
+    cache->random_state = 0x2545F491;
+}
+
+void free_cache(struct CacheSim *cache)
+{
+    free(cache->tags);
+    free(cache->stamps);
+    free(cache->valid);
+}
+
+void cache_access_line(struct CacheSim *cache, u_int32_t line)
+{
+    u_int32_t set = line % cache->set_count;
+    u_int32_t tag = line / cache->set_count;
+    u_int32_t base = set * cache->config.ways;
+    cache->clock++;
+
+    u_int32_t victim = base;
+    for (u_int32_t way = base; way < base + cache->config.ways; ++way)
+    {
+        if (cache->valid[way] && cache->tags[way] == tag)
+        {
+            cache->hits++;
+            if (cache->config.policy == POLICY_LRU)
+            {
+                cache->stamps[way] = cache->clock;
+            }
+            return;
+        }
+
+        // Prefer an empty way, otherwise the oldest stamp.
+        if (!cache->valid[way])
+        {
+            if (cache->valid[victim])
+            {
+                victim = way;
+            }
+        }
+        else if (cache->valid[victim] && cache->stamps[way] < cache->stamps[victim])
+        {
+            victim = way;
+        }
+    }
+
+    cache->misses++;
+    if (cache->valid[victim])
+    {
+        cache->evictions++;
+        if (cache->config.policy == POLICY_RANDOM)
+        {
+            cache->random_state ^= cache->random_state << 13;
+            cache->random_state ^= cache->random_state >> 17;
+            cache->random_state ^= cache->random_state << 5;
+            victim = base + cache->random_state % cache->config.ways;
+        }
+    }
+
+    cache->valid[victim] = true;
+    cache->tags[victim] = tag;
+    cache->stamps[victim] = cache->clock;
+}
+
+// An access that straddles a line boundary touches every line it covers. The
+// caller splits accesses that wrap past 0xFFFF.
+void cache_access(struct CacheSim *cache, u_int32_t address, u_int32_t size)
+{
+    u_int32_t first = address / cache->config.line_size;
+    u_int32_t last = (address + size - 1) / cache->config.line_size;
+    for (u_int32_t line = first; line <= last; ++line)
+    {
+        cache_access_line(cache, line);
+    }
+}
+
+void print_cache_stats(struct CacheSim *cache)
+{
+    u_int64_t accesses = cache->hits + cache->misses;
+    if (cache->config.tlb)
+    {
+        printf("%s %u entries %u-way %uB pages", cache->config.name, cache->config.size / cache->config.line_size,
+               cache->config.ways, cache->config.line_size);
+    }
+    else
+    {
+        printf("%s %uB %u-way %uB lines", cache->config.name, cache->config.size, cache->config.ways,
+               cache->config.line_size);
+    }
+    printf(" %s (%u sets): %llu accesses, %llu hits, %llu misses (%.2f%% hit rate), %llu evictions\n",
+           cache_policy_names[cache->config.policy], cache->set_count, (unsigned long long)accesses,
+           (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+           accesses ? 100.0 * (double)cache->hits / (double)accesses : 0.0, (unsigned long long)cache->evictions);
+}
+
+// LRU stack (reuse) distance per line: the number of distinct lines touched
+// since the previous access to the same line. Kept as a move-to-front list,
+// which is fine for a 64 KB address space.
+#define REUSE_BUCKETS 18
+
+struct ReuseDistance
+{
+    u_int32_t line_size;
+    u_int32_t *stack;
+    u_int32_t depth;
+
+    u_int64_t cold;
+    u_int64_t buckets[REUSE_BUCKETS];
+};
+
+void init_reuse_distance(struct ReuseDistance *reuse, u_int32_t line_size)
+{
+    memset(reuse, 0, sizeof(*reuse));
+    reuse->line_size = line_size;
+    reuse->stack = malloc((65536 / line_size + 1) * sizeof(u_int32_t));
+}
+
+void reuse_access(struct ReuseDistance *reuse, u_int32_t address, u_int32_t size)
+{
+    u_int32_t first = address / reuse->line_size;
+    u_int32_t last = (address + size - 1) / reuse->line_size;
+    for (u_int32_t line = first; line <= last; ++line)
+    {
+        u_int32_t distance = 0;
+        while (distance < reuse->depth && reuse->stack[distance] != line)
+        {
+            distance++;
+        }
+
+        if (distance == reuse->depth)
+        {
+            reuse->cold++;
+            reuse->depth++;
+        }
+        else
+        {
+            int bucket = 0;
+            while (bucket < REUSE_BUCKETS - 1 && (1u << bucket) <= distance)
+            {
+                bucket++;
+            }
+            reuse->buckets[bucket]++;
+        }
+
+        memmove(reuse->stack + 1, reuse->stack, distance * sizeof(u_int32_t));
+        reuse->stack[0] = line;
+    }
+}
+
+void print_reuse_distance(struct ReuseDistance *reuse, const char *unit)
+{
+    printf("REUSE DISTANCE (%uB %s, %u distinct): cold %llu", reuse->line_size, unit, reuse->depth,
+           (unsigned long long)reuse->cold);
+    for (int bucket = 0; bucket < REUSE_BUCKETS; ++bucket)
+    {
+        if (reuse->buckets[bucket])
+        {
+            printf(", <%u: %llu", 1u << bucket, (unsigned long long)reuse->buckets[bucket]);
+        }
+    }
+    printf("\n");
+}
+
+void free_reuse_distance(struct ReuseDistance *reuse)
+{
+    free(reuse->stack);
+}
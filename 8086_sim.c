@@ -2,31 +2,40 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "8086_cache_sim.c"
+
+// Byte registers live in the low (al..bl) or high (ah..bh) half of the word
+// register at memory_index.
 struct Register
 {
     u_int8_t memory_index;
     char name[3];
     bool wide;
+    bool high;
 };
 
 struct Register reg_lookup_table[2][8] = {
-    {{0, "al", false},
-     {1, "cl", false},
-     {2, "dl", false},
-     {3, "bl", false},
-     {0, "ah", false},
-     {1, "ch", false},
-     {2, "dh", false},
-     {3, "bh", false}},
-    {{0, "ax", true},
-     {1, "cx", true},
-     {2, "dx", true},
-     {3, "bx", true},
-     {4, "sp", true},
-     {5, "bp", true},
-     {6, "si", true},
-     {7, "di", true}}};
+    {{0, "al", false, false},
+     {1, "cl", false, false},
+     {2, "dl", false, false},
+     {3, "bl", false, false},
+     {0, "ah", false, true},
+     {1, "ch", false, true},
+     {2, "dh", false, true},
+     {3, "bh", false, true}},
+    {{0, "ax", true, false},
+     {1, "cx", true, false},
+     {2, "dx", true, false},
+     {3, "bx", true, false},
+     {4, "sp", true, false},
+     {5, "bp", true, false},
+     {6, "si", true, false},
+     {7, "di", true, false}}};
 
 const char *eff_acc_table[8] = {
     "bx + si", "bx + di", "bp + si", "bp + di", "si", "di", "bp", "bx"};
@@ -40,62 +49,285 @@ const char *jump_commands[16] = {
 const char *other_comp_commands[4] = {
     "loopnz", "loopz", "loop", "jcxz"};
 
-u_int16_t register_mem[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+// Hotspot profiling of the simulated program, keyed by instruction address.
+enum OpcodeClass
+{
+    OP_MOV_REG_MEM,
+    OP_MOV_IMM_RGM,
+    OP_MOV_IMM_REG,
+    OP_MOV_MEM_ACC,
+    OP_ARITH_REG_MEM,
+    OP_ARITH_IMM_RGM,
+    OP_ARITH_IMM_ACC,
+    OP_JUMP,
+    OP_LOOP,
+    OP_UNKNOWN,
+    OP_CLASS_COUNT,
+};
+
+const char *opcode_class_names[OP_CLASS_COUNT] = {
+    "mov r/m, reg", "mov r/m, imm", "mov reg, imm", "mov acc, mem", "arith r/m, reg",
+    "arith r/m, imm", "arith acc, imm", "jcc", "loop/jcxz", "unknown"};
+
+struct InstructionProfile
+{
+    u_int64_t hits;
+    u_int64_t cycles;
+    u_int64_t back_edges_taken;
+    u_int16_t back_edge_target;
+    u_int8_t opcode_class;
+    char disassembly[64]; // as long as Machine.instruction_text
+};
+
+struct OpcodeClassProfile
+{
+    u_int64_t hits;
+    u_int64_t cycles;
+};
+
+struct MachineProfile
+{
+    struct InstructionProfile instructions[65536];
+    struct OpcodeClassProfile classes[OP_CLASS_COUNT];
+};
+
+#define SNAPSHOT_PAGE_SIZE 256
+#define SNAPSHOT_PAGE_COUNT (65536 / SNAPSHOT_PAGE_SIZE)
+
+struct MachineSnapshot;
+
+// Optional record of every data memory access, in program order.
+struct MemoryAccess
+{
+    u_int16_t address;
+    u_int8_t size;
+    bool write;
+};
+
+struct MemoryTrace
+{
+    struct MemoryAccess *accesses;
+    size_t count;
+    size_t capacity;
+};
+
+// Flags are evaluated lazily: arithmetic only records its operands and result,
+// and the individual flags are derived when a conditional jump (or ADC/SBB)
+// reads them. op is the arith_instr index + 1, or FLAGS_MATERIALIZED when
+// result already holds the flag bits.
+#define FLAGS_MATERIALIZED 0
+
+#define FLAG_CF 0x0001
+#define FLAG_PF 0x0004
+#define FLAG_AF 0x0010
+#define FLAG_ZF 0x0040
+#define FLAG_SF 0x0080
+#define FLAG_OF 0x0800
+
+struct LazyFlags
+{
+    u_int16_t a;
+    u_int16_t b;
+    u_int16_t result;
+    u_int8_t op;
+    bool wide;
+    bool carry_in;
+};
+
+// All state of one simulated machine. Code is loaded at address 0 of
+// program_memory and executed from there.
+struct Machine
+{
+    u_int16_t register_mem[8];
+
+    u_int16_t instruction_pointer;
+    u_int32_t instruction_size;
+
+    struct LazyFlags flags;
+
+    size_t num_cycles;
+
+    char instruction_text[64];
+
+    // Only allocated when profiling or tracing.
+    struct MachineProfile *profile;
+    struct MemoryTrace *trace;
+
+    // Snapshot this machine was last restored from or taken as, and the
+    // memory pages written since then.
+    const struct MachineSnapshot *snapshot_origin;
+    u_int64_t dirty_pages[SNAPSHOT_PAGE_COUNT / 64];
+
+    // Simulation stops when the IP reaches this address (-1 to run to the end),
+    // or after step_limit instructions (0 for no limit).
+    int32_t break_address;
+    size_t step_limit;
+
+    u_int8_t program_memory[65536];
+};
+
+int profile_top_n = 10;
+
+void record_memory_access(struct MemoryTrace *trace, u_int16_t address, u_int8_t size, bool write)
+{
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->accesses = realloc(trace->accesses, trace->capacity * sizeof(struct MemoryAccess));
+    }
+    trace->accesses[trace->count++] = (struct MemoryAccess){address, size, write};
+}
+
+void mark_dirty(struct Machine *m, u_int16_t address)
+{
+    u_int16_t page = address / SNAPSHOT_PAGE_SIZE;
+    m->dirty_pages[page / 64] |= 1ull << (page % 64);
+}
+
+void record_instruction(struct Machine *m, u_int16_t address, u_int8_t opcode_class, size_t cycles)
+{
+    struct InstructionProfile *profile = &m->profile->instructions[address];
+    if (profile->hits == 0)
+    {
+        profile->opcode_class = opcode_class;
+        snprintf(profile->disassembly, sizeof(profile->disassembly), "%s", m->instruction_text);
+    }
+    profile->hits++;
+    profile->cycles += cycles;
+
+    // Any transfer to an earlier address closes a loop; count its trips.
+    if (m->instruction_pointer <= address)
+    {
+        profile->back_edges_taken++;
+        profile->back_edge_target = m->instruction_pointer;
+    }
+
+    m->profile->classes[opcode_class].hits++;
+    m->profile->classes[opcode_class].cycles += cycles;
+}
+
+int compare_profile_cycles(const void *a, const void *b)
+{
+    const struct InstructionProfile *pa = *(const struct InstructionProfile **)a;
+    const struct InstructionProfile *pb = *(const struct InstructionProfile **)b;
+    if (pa->cycles != pb->cycles)
+    {
+        return pa->cycles < pb->cycles ? 1 : -1;
+    }
+    if (pa->hits != pb->hits)
+    {
+        return pa->hits < pb->hits ? 1 : -1;
+    }
+    return pa < pb ? -1 : 1;
+}
+
+void print_profile(struct Machine *m)
+{
+    static struct InstructionProfile *entries[65536];
+    int address_count = 0;
+    for (int i = 0; i < 65536; ++i)
+    {
+        if (m->profile->instructions[i].hits)
+        {
+            entries[address_count++] = &m->profile->instructions[i];
+        }
+    }
+    qsort(entries, address_count, sizeof(entries[0]), compare_profile_cycles);
 
-u_int16_t instruction_pointer;
-u_int16_t instruction_size;
+    double total = m->num_cycles ? (double)m->num_cycles : 1.0;
+    int shown = address_count < profile_top_n ? address_count : profile_top_n;
 
-bool sign_flag = 0;
-bool zero_flag = 0;
+    printf("\nHOTSPOTS (top %d of %d addresses by cycles):\n", shown, address_count);
+    printf("%6s %10s %12s %8s %8s  %-16s %s\n", "addr", "hits", "cycles", "%total", "cyc/hit", "class", "disassembly");
+    for (int i = 0; i < shown; ++i)
+    {
+        struct InstructionProfile *profile = entries[i];
+        printf("0x%04x %10llu %12llu %7.2f%% %8.2f  %-16s %s\n", (int)(profile - m->profile->instructions),
+               (unsigned long long)profile->hits, (unsigned long long)profile->cycles,
+               100.0 * (double)profile->cycles / total, (double)profile->cycles / (double)profile->hits,
+               opcode_class_names[profile->opcode_class], profile->disassembly);
+    }
 
-u_int8_t instruction_memory[1024];
-u_int8_t program_memory[65536];
+    printf("\nOPCODE CLASSES:\n");
+    for (int i = 0; i < OP_CLASS_COUNT; ++i)
+    {
+        struct OpcodeClassProfile *profile = &m->profile->classes[i];
+        if (profile->hits)
+        {
+            printf("%-16s %10llu hits %12llu cycles (%.2f%%)\n", opcode_class_names[i],
+                   (unsigned long long)profile->hits, (unsigned long long)profile->cycles,
+                   100.0 * (double)profile->cycles / total);
+        }
+    }
 
-size_t num_cycles;
+    printf("\nLOOP BACK-EDGES:\n");
+    for (int i = 0; i < address_count; ++i)
+    {
+        struct InstructionProfile *profile = entries[i];
+        int address = (int)(profile - m->profile->instructions);
+        if (profile->back_edges_taken)
+        {
+            // Every fall-through of a back-edge is one loop exit, i.e. one entry.
+            u_int64_t exits = profile->hits - profile->back_edges_taken;
+            printf("0x%04x -> 0x%04x  %-16s taken %llu", address, profile->back_edge_target,
+                   profile->disassembly, (unsigned long long)profile->back_edges_taken);
+            if (exits)
+            {
+                printf(", entered %llu, avg trip count %.2f", (unsigned long long)exits,
+                       (double)profile->hits / (double)exits);
+            }
+            else
+            {
+                printf(", never exited");
+            }
+            printf("\n");
+        }
+    }
+}
 
-int calc_effective_address(int index)
+int calc_effective_address(struct Machine *m, int index)
 {
     int result;
     switch (index)
     {
     case 0:
     {
-        result = register_mem[3] + register_mem[6];
+        result = m->register_mem[3] + m->register_mem[6];
         break;
     }
     case 1:
     {
-        result = register_mem[3] + register_mem[7];
+        result = m->register_mem[3] + m->register_mem[7];
         break;
     }
     case 2:
     {
-        result = register_mem[5] + register_mem[6];
+        result = m->register_mem[5] + m->register_mem[6];
         break;
     }
     case 3:
     {
-        result = register_mem[5] + register_mem[7];
+        result = m->register_mem[5] + m->register_mem[7];
         break;
     }
     case 4:
     {
-        result = register_mem[6];
+        result = m->register_mem[6];
         break;
     }
     case 5:
     {
-        result = register_mem[7];
+        result = m->register_mem[7];
         break;
     }
     case 6:
     {
-        result = register_mem[5];
+        result = m->register_mem[5];
         break;
     }
     case 7:
     {
-        result = register_mem[3];
+        result = m->register_mem[3];
         break;
     }
     }
@@ -127,21 +359,21 @@ int get_signed_number(int data_lo, int data_hi, bool wide)
     return data;
 }
 
-int get_num_from_file(bool wide, bool sign_extend, FILE *file)
+int get_num_from_file(struct Machine *m, bool wide, bool sign_extend)
 {
     unsigned char num_lo;
     unsigned char num_hi;
 
-    num_lo = instruction_memory[instruction_pointer++];
+    num_lo = m->program_memory[m->instruction_pointer++];
     if (wide && !sign_extend)
     {
-        num_hi = instruction_memory[instruction_pointer++];
+        num_hi = m->program_memory[m->instruction_pointer++];
     }
 
     return get_signed_number((int)num_lo, (int)num_hi, wide && !sign_extend);
 }
 
-int create_mem_reg_str(FILE *file, char mod, char r_m, bool w, char *str)
+int create_mem_reg_str(struct Machine *m, char mod, char r_m, bool w, char *str)
 {
     int disp;
     switch (mod)
@@ -154,7 +386,7 @@ int create_mem_reg_str(FILE *file, char mod, char r_m, bool w, char *str)
     {
         bool wide = mod % 2 == 0;
         char *reg = eff_acc_table[r_m];
-        disp = get_num_from_file(wide, false, file);
+        disp = get_num_from_file(m, wide, false);
 
         if (disp < 0)
         {
@@ -176,7 +408,7 @@ int create_mem_reg_str(FILE *file, char mod, char r_m, bool w, char *str)
 
         if (r_m == 6)
         {
-            int addr = get_num_from_file(true, false, file);
+            int addr = get_num_from_file(m, true, false);
             disp = addr;
             sprintf(str, "[%d]", addr);
         }
@@ -194,91 +426,240 @@ int create_mem_reg_str(FILE *file, char mod, char r_m, bool w, char *str)
     return disp;
 }
 
-void print_maybe_flip(char *instr, char *reg, char *mem_reg_str, bool d)
+void print_maybe_flip(struct Machine *m, char *instr, char *reg, char *mem_reg_str, bool d)
 {
     if (d == 0)
     {
-        printf("%s %s, %s\n", instr, mem_reg_str, reg);
+        sprintf(m->instruction_text, "%s %s, %s", instr, mem_reg_str, reg);
     }
     else
     {
-        printf("%s %s, %s\n", instr, reg, mem_reg_str);
+        sprintf(m->instruction_text, "%s %s, %s", instr, reg, mem_reg_str);
+    }
+}
+
+// Computes every flag of the last flag-writing instruction in one pass,
+// without branching on the operation's result.
+u_int16_t flag_bits(const struct LazyFlags *flags)
+{
+    if (flags->op == FLAGS_MATERIALIZED)
+    {
+        return flags->result;
     }
+
+    u_int32_t mask = flags->wide ? 0xFFFF : 0xFF;
+    u_int32_t sign_bit = flags->wide ? 0x8000 : 0x80;
+    u_int32_t a = flags->a & mask;
+    u_int32_t b = flags->b & mask;
+    u_int32_t result = flags->result & mask;
+    u_int32_t carry_in = flags->carry_in;
+
+    u_int8_t instr_idx = flags->op - 1;
+    bool is_add = instr_idx == 0 || instr_idx == 2;
+    bool is_sub = instr_idx == 3 || instr_idx == 5 || instr_idx == 7;
+
+    u_int32_t carry = is_add * (a + b + carry_in > mask) | is_sub * (a < b + carry_in);
+    u_int32_t overflow = is_add * (((a ^ result) & (b ^ result) & sign_bit) != 0) |
+                         is_sub * (((a ^ b) & (a ^ result) & sign_bit) != 0);
+    u_int32_t aux_carry = (is_add | is_sub) * (((a ^ b ^ result) & 0x10) != 0);
+    u_int32_t parity = !__builtin_parity(result & 0xFF);
+
+    return (carry ? FLAG_CF : 0) | (parity ? FLAG_PF : 0) | (aux_carry ? FLAG_AF : 0) |
+           (result == 0 ? FLAG_ZF : 0) | ((result & sign_bit) ? FLAG_SF : 0) | (overflow ? FLAG_OF : 0);
+}
+
+bool flag_set(const struct LazyFlags *flags, u_int16_t flag)
+{
+    return (flag_bits(flags) & flag) != 0;
 }
 
-void write_flags(u_int16_t data)
+// Evaluates a jump_commands condition, deriving only the flags it needs for
+// the common equality tests.
+bool jump_condition(const struct LazyFlags *flags, u_int8_t instr_index)
 {
-    if (data & 0x8000)
+    bool taken;
+    if ((instr_index >> 1) == 2 && flags->op != FLAGS_MATERIALIZED) // je/jne
     {
-        sign_flag = 1;
+        taken = (flags->result & (flags->wide ? 0xFFFF : 0xFF)) == 0;
     }
     else
     {
-        sign_flag = 0;
+        u_int16_t bits = flag_bits(flags);
+        bool sf_ne_of = ((bits & FLAG_SF) != 0) != ((bits & FLAG_OF) != 0);
+        switch (instr_index >> 1)
+        {
+        case 0: // jo
+            taken = bits & FLAG_OF;
+            break;
+        case 1: // jb
+            taken = bits & FLAG_CF;
+            break;
+        case 2: // je
+            taken = bits & FLAG_ZF;
+            break;
+        case 3: // jbe
+            taken = bits & (FLAG_CF | FLAG_ZF);
+            break;
+        case 4: // js
+            taken = bits & FLAG_SF;
+            break;
+        case 5: // jp
+            taken = bits & FLAG_PF;
+            break;
+        case 6: // jl
+            taken = sf_ne_of;
+            break;
+        default: // jle
+            taken = sf_ne_of || (bits & FLAG_ZF);
+            break;
+        }
+    }
+
+    // Odd entries of jump_commands are the negated conditions.
+    return taken != (instr_index & 1);
+}
+
+u_int16_t read_register(const struct Machine *m, struct Register reg)
+{
+    u_int16_t value = m->register_mem[reg.memory_index];
+    if (reg.wide)
+    {
+        return value;
     }
+    return reg.high ? value >> 8 : value & 0xFF;
+}
 
-    if (data == 0)
+// Byte writes only replace the addressed half of the word register.
+void write_register(struct Machine *m, struct Register reg, u_int16_t value)
+{
+    u_int16_t *slot = &m->register_mem[reg.memory_index];
+    if (reg.wide)
     {
-        zero_flag = 1;
+        *slot = value;
+    }
+    else if (reg.high)
+    {
+        *slot = (*slot & 0x00FF) | (u_int16_t)((value & 0xFF) << 8);
     }
     else
     {
-        zero_flag = 0;
+        *slot = (*slot & 0xFF00) | (value & 0xFF);
     }
 }
 
-void perform_instruction_reg(u_int8_t instr_idx, u_int8_t rto, u_int16_t value)
+// Computes an arith_instr operation on a and value and records its flags.
+u_int16_t perform_arith(struct Machine *m, u_int8_t instr_idx, u_int16_t a, u_int16_t value, bool wide)
 {
+    bool carry_in = false;
+    if (instr_idx == 2 || instr_idx == 3) // ADC, SBB
+    {
+        carry_in = flag_set(&m->flags, FLAG_CF);
+    }
+
+    u_int16_t result;
     switch (instr_idx)
     {
     case 0: // ADD
-    {
-        u_int16_t result = register_mem[rto] + value;
-        register_mem[rto] = result;
-        write_flags(result);
+    case 2: // ADC
+        result = a + value + carry_in;
+        break;
+    case 1: // OR
+        result = a | value;
+        break;
+    case 4: // AND
+        result = a & value;
+        break;
+    case 6: // XOR
+        result = a ^ value;
+        break;
+    default: // SUB, SBB, CMP
+        result = a - value - carry_in;
         break;
     }
-    case 5: // SUB
+
+    m->flags.a = a;
+    m->flags.b = value;
+    m->flags.result = result;
+    m->flags.op = instr_idx + 1;
+    m->flags.wide = wide;
+    m->flags.carry_in = carry_in;
+    return result;
+}
+
+void perform_instruction_reg(struct Machine *m, u_int8_t instr_idx, struct Register to, u_int16_t value)
+{
+    u_int16_t result = perform_arith(m, instr_idx, read_register(m, to), value, to.wide);
+    if (instr_idx != 7) // CMP only sets flags
     {
-        u_int16_t result = register_mem[rto] - value;
-        register_mem[rto] = result;
-        write_flags(result);
-        break;
+        write_register(m, to, result);
     }
-    case 7: // CMP
+}
+
+u_int16_t operand_address(struct Machine *m, u_int8_t r_m, int mod, u_int16_t disp)
+{
+    return ((mod == 0 && r_m == 6) ? 0 : calc_effective_address(m, r_m)) + disp;
+}
+
+// Data memory accesses, traced with their real size.
+u_int16_t read_memory(struct Machine *m, u_int16_t address, bool wide)
+{
+    if (m->trace)
     {
-        u_int16_t result = register_mem[rto] - value;
-        write_flags(result);
+        record_memory_access(m->trace, address, wide ? 2 : 1, false);
     }
-    default:
-        break;
+    u_int16_t value = m->program_memory[address];
+    if (wide)
+    {
+        value |= m->program_memory[(u_int16_t)(address + 1)] << 8;
     }
+    return value;
 }
 
-void mov_instruction_mem(u_int8_t offset_idx, bool d, struct Register reg, int value, u_int16_t offset, int mod)
+void write_memory(struct Machine *m, u_int16_t address, u_int16_t value, bool wide)
 {
+    if (m->trace)
+    {
+        record_memory_access(m->trace, address, wide ? 2 : 1, true);
+    }
+    m->program_memory[address] = value & 0xFF;
+    mark_dirty(m, address);
+    if (wide)
+    {
+        m->program_memory[(u_int16_t)(address + 1)] = value >> 8;
+        mark_dirty(m, address + 1);
+    }
+}
 
-    int address = ((mod == 0 && offset_idx == 6) ? 0 : calc_effective_address(offset_idx)) + offset;
+void mov_instruction_mem(struct Machine *m, u_int8_t offset_idx, bool d, struct Register reg, int value, u_int16_t offset, int mod)
+{
+    u_int16_t address = operand_address(m, offset_idx, mod, offset);
 
     if (d == 1)
     {
-        u_int16_t low = program_memory[address];
-        u_int16_t high = program_memory[address + 1];
-        register_mem[reg.memory_index] = (high << 8) + low;
+        write_register(m, reg, read_memory(m, address, reg.wide));
     }
     else
     {
-        program_memory[address] = value & 0xFF;
-        program_memory[address + 1] = value >> 8;
+        write_memory(m, address, value, reg.wide);
+    }
+}
+
+// Read-modify-write of a memory destination; CMP only reads.
+void perform_instruction_mem(struct Machine *m, u_int8_t instr_idx, u_int16_t address, u_int16_t value, bool wide)
+{
+    u_int16_t result = perform_arith(m, instr_idx, read_memory(m, address, wide), value, wide);
+    if (instr_idx != 7)
+    {
+        write_memory(m, address, result, wide);
     }
 }
 
-void calc_effective_address_cycles(u_int8_t r_m, u_int16_t mod, u_int16_t disp)
+void calc_effective_address_cycles(struct Machine *m, u_int8_t r_m, u_int16_t mod, u_int16_t disp)
 {
 
     if (mod == 0 && r_m == 6)
     {
-        num_cycles += 6;
+        m->num_cycles += 6;
     }
     else
     {
@@ -286,67 +667,69 @@ void calc_effective_address_cycles(u_int8_t r_m, u_int16_t mod, u_int16_t disp)
         {
             if (disp > 0)
             {
-                num_cycles += 11;
+                m->num_cycles += 11;
             }
             else
             {
-                num_cycles += 7;
+                m->num_cycles += 7;
             }
         }
         else if (r_m == 1 || r_m == 2)
         {
             if (disp > 0)
             {
-                num_cycles += 12;
+                m->num_cycles += 12;
             }
             else
             {
-                num_cycles += 8;
+                m->num_cycles += 8;
             }
         }
         else
         {
             if (disp > 0)
             {
-                num_cycles += 9;
+                m->num_cycles += 9;
             }
             else
             {
-                num_cycles += 5;
+                m->num_cycles += 5;
             }
         }
     }
 }
 
-int main(int argc, char **argv)
+// Loads a listing at address 0 of program_memory. Returns an error message on failure.
+const char *load_program(struct Machine *m, const char *filename)
 {
-
-    // File handling
-    if (argc != 2)
-    {
-        printf("Wrong number of arguments!\n");
-        exit(1);
-    }
-
-    char *filename = argv[1];
     FILE *file = fopen(filename, "rb");
 
     if (file == NULL)
     {
-        printf("Error opening file %s\n", filename);
-        exit(1);
+        return "Error opening file";
     }
 
-    instruction_size = fread(instruction_memory, 1, sizeof(instruction_memory), file);
-    if (instruction_size == 0)
+    m->instruction_size = fread(m->program_memory, 1, sizeof(m->program_memory), file);
+    fclose(file);
+    if (m->instruction_size == 0)
     {
-        printf("Error reading file or file is empty\n");
-        exit(1);
+        return "Error reading file or file is empty";
     }
 
-    instruction_pointer = 0;
-    num_cycles = 0;
+    m->instruction_pointer = 0;
+    m->num_cycles = 0;
+    m->break_address = -1;
+
+    m->snapshot_origin = NULL;
+    for (u_int32_t address = 0; address < m->instruction_size; address += SNAPSHOT_PAGE_SIZE)
+    {
+        mark_dirty(m, address);
+    }
+    return NULL;
+}
 
+void simulate(struct Machine *m, bool verbose)
+{
     // constants
     unsigned char instr_1;
     unsigned char instr_2;
@@ -360,19 +743,21 @@ int main(int argc, char **argv)
     const unsigned char MOV_IMM_REG = 0xB;
     const unsigned char MOV_MEM_ACC = 0x28;
 
-    const unsigned char LOOP = 0xE2;
-    const unsigned char LOOPS = 0xE1;
-    const unsigned char LOOPNZ = 0xE0;
-    const unsigned char JCXZ = 0xE3;
-
     // main loop
 
-    while (instruction_pointer < instruction_size)
+    size_t steps = 0;
+    while (m->instruction_pointer < m->instruction_size && m->instruction_pointer != m->break_address &&
+           (m->step_limit == 0 || steps++ < m->step_limit))
     {
-        u_int8_t instr_1 = instruction_memory[instruction_pointer++];
+        u_int16_t instruction_address = m->instruction_pointer;
+        size_t instruction_start_cycles = m->num_cycles;
+        u_int8_t opcode_class = OP_UNKNOWN;
+
+        u_int8_t instr_1 = m->program_memory[m->instruction_pointer++];
         if (instr_1 >> 2 == MOV_REG_MEM)
         {
-            u_int8_t instr_2 = instruction_memory[instruction_pointer++];
+            opcode_class = OP_MOV_REG_MEM;
+            u_int8_t instr_2 = m->program_memory[m->instruction_pointer++];
             bool d = instr_1 & 2;
             bool w = instr_1 & 1;
 
@@ -383,34 +768,33 @@ int main(int argc, char **argv)
             struct Register reg_to = reg_lookup_table[w][reg];
             char *mem_reg = malloc(20);
 
-            int disp = create_mem_reg_str(file, mod, r_m, w, mem_reg);
-            print_maybe_flip("mov", reg_to.name, mem_reg, d);
+            int disp = create_mem_reg_str(m, mod, r_m, w, mem_reg);
+            print_maybe_flip(m, "mov", reg_to.name, mem_reg, d);
 
             if (mod == 3)
             {
+                struct Register rm_reg = reg_lookup_table[w][r_m];
                 if (d == 0)
                 {
-
-                    register_mem[r_m] = register_mem[reg_to.memory_index];
+                    write_register(m, rm_reg, read_register(m, reg_to));
                 }
                 else
                 {
-
-                    register_mem[reg_to.memory_index] = register_mem[r_m];
+                    write_register(m, reg_to, read_register(m, rm_reg));
                 }
-                num_cycles += 2;
+                m->num_cycles += 2;
             }
             else
             {
-                mov_instruction_mem(r_m, d, reg_to, register_mem[reg_to.memory_index], disp, mod);
-                calc_effective_address_cycles(r_m, mod, disp);
+                mov_instruction_mem(m, r_m, d, reg_to, read_register(m, reg_to), disp, mod);
+                calc_effective_address_cycles(m, r_m, mod, disp);
                 if (d == 0)
                 {
-                    num_cycles += 9;
+                    m->num_cycles += 9;
                 }
                 else
                 {
-                    num_cycles += 8;
+                    m->num_cycles += 8;
                 }
             }
 
@@ -418,7 +802,8 @@ int main(int argc, char **argv)
         }
         else if (instr_1 >> 1 == MOV_IMM_RGM)
         {
-            u_int8_t instr_2 = instruction_memory[instruction_pointer++];
+            opcode_class = OP_MOV_IMM_RGM;
+            u_int8_t instr_2 = m->program_memory[m->instruction_pointer++];
             bool w = instr_1 & 1;
 
             char mod = instr_2 >> 6;
@@ -426,20 +811,20 @@ int main(int argc, char **argv)
 
             char *to = malloc(20);
 
-            int disp = create_mem_reg_str(file, mod, r_m, w, to);
+            int disp = create_mem_reg_str(m, mod, r_m, w, to);
 
-            int data = get_num_from_file(w, false, file);
+            int data = get_num_from_file(m, w, false);
 
             if (mod == 3)
             {
-                register_mem[reg_lookup_table[1][r_m].memory_index] = data;
-                num_cycles += 4;
+                write_register(m, reg_lookup_table[w][r_m], data);
+                m->num_cycles += 4;
             }
             else
             {
-                mov_instruction_mem(r_m, 0, reg_lookup_table[0][0], data, disp, mod);
-                calc_effective_address_cycles(r_m, mod, disp);
-                num_cycles += 10;
+                mov_instruction_mem(m, r_m, 0, reg_lookup_table[w][0], data, disp, mod);
+                calc_effective_address_cycles(m, r_m, mod, disp);
+                m->num_cycles += 10;
             }
 
             char num_info[5];
@@ -451,95 +836,109 @@ int main(int argc, char **argv)
             {
                 memcpy(num_info, "byte", 5);
             }
-            printf("mov %s, %s %d\n", to, num_info, data);
+            sprintf(m->instruction_text, "mov %s, %s %d", to, num_info, data);
             free(to);
         }
         else if (instr_1 >> 4 == MOV_IMM_REG)
         {
+            opcode_class = OP_MOV_IMM_REG;
             bool w = (instr_1 >> 3) & 1;
             char reg = instr_1 & 7;
             struct Register actual_reg = reg_lookup_table[w][reg];
-            int data = get_num_from_file(w, false, file);
+            int data = get_num_from_file(m, w, false);
 
-            register_mem[actual_reg.memory_index] = (u_int16_t)data;
+            write_register(m, actual_reg, (u_int16_t)data);
 
-            printf("mov %s, %d\n", actual_reg.name, data);
+            sprintf(m->instruction_text, "mov %s, %d", actual_reg.name, data);
 
-            num_cycles += 4;
+            m->num_cycles += 4;
         }
         else if (instr_1 >> 2 == MOV_MEM_ACC)
         {
+            opcode_class = OP_MOV_MEM_ACC;
 
             bool d = instr_1 & 2;
             bool w = instr_1 & 1;
-            // TODO fix sign
-            int addr = get_num_from_file(w, false, file);
-
-            char *reg;
+            // The address is always 16 bits; w only selects al or ax.
+            u_int16_t addr = get_num_from_file(m, true, false);
+            struct Register acc = reg_lookup_table[w][0];
 
             if (d)
             {
-                printf("mov [%d], ax\n", addr);
+                write_memory(m, addr, read_register(m, acc), w);
+                sprintf(m->instruction_text, "mov [%d], %s", addr, acc.name);
             }
             else
             {
-                printf("mov ax, [%d]\n", addr);
+                write_register(m, acc, read_memory(m, addr, w));
+                sprintf(m->instruction_text, "mov %s, [%d]", acc.name, addr);
             }
 
-            num_cycles += 10;
+            m->num_cycles += 10;
         }
         else if (instr_1 >> 6 == 0 && (instr_1 & (1 << 2)) == 0) // regular ADD, SUB, CMP, etc.
         {
+            opcode_class = OP_ARITH_REG_MEM;
             char instr_idx = (instr_1 >> 3) & 7;
             char *instr_name = arith_instr[instr_idx];
             bool d = instr_1 & 2;
             bool w = instr_1 & 1;
 
-            u_int8_t instr_2 = instruction_memory[instruction_pointer++];
+            u_int8_t instr_2 = m->program_memory[m->instruction_pointer++];
             char mod = instr_2 >> 6;
             char reg = (instr_2 >> 3) & 7;
             char r_m = instr_2 & 7;
             struct Register reg_to = reg_lookup_table[w][reg];
             char *mem_reg = malloc(20);
 
-            int disp = create_mem_reg_str(file, mod, r_m, w, mem_reg);
-            print_maybe_flip(instr_name, reg_to.name, mem_reg, d);
+            int disp = create_mem_reg_str(m, mod, r_m, w, mem_reg);
+            print_maybe_flip(m, instr_name, reg_to.name, mem_reg, d);
+
+            if (mod == 3)
+            {
+                struct Register rm_reg = reg_lookup_table[w][r_m];
+                struct Register rto = d ? reg_to : rm_reg;
+                struct Register rfr = d ? rm_reg : reg_to;
 
-            int rto = reg_to.memory_index;
-            int rfr = r_m;
-            if (d == 0)
+                perform_instruction_reg(m, instr_idx, rto, read_register(m, rfr));
+            }
+            else if (d)
             {
-                rfr = reg_to.memory_index;
-                rto = r_m;
+                u_int16_t address = operand_address(m, r_m, mod, disp);
+                perform_instruction_reg(m, instr_idx, reg_to, read_memory(m, address, w));
+            }
+            else
+            {
+                u_int16_t address = operand_address(m, r_m, mod, disp);
+                perform_instruction_mem(m, instr_idx, address, read_register(m, reg_to), w);
             }
-
-            perform_instruction_reg(instr_idx, rto, register_mem[rfr]);
 
             free(mem_reg);
 
             if (mod == 3)
             {
-                num_cycles += 3;
+                m->num_cycles += 3;
             }
             else
             {
-                calc_effective_address_cycles(r_m, mod, disp);
+                calc_effective_address_cycles(m, r_m, mod, disp);
                 if (d == 0)
                 {
-                    num_cycles += 16;
+                    m->num_cycles += 16;
                 }
                 else
                 {
-                    num_cycles += 9;
+                    m->num_cycles += 9;
                 }
             }
         }
         else if (instr_1 >> 2 == (1 << 5)) // immediate to reg/mem ADD, SUB, CMP, etc.
         {
+            opcode_class = OP_ARITH_IMM_RGM;
             bool s = instr_1 & 2;
             bool w = instr_1 & 1;
 
-            u_int8_t instr_2 = instruction_memory[instruction_pointer++];
+            u_int8_t instr_2 = m->program_memory[m->instruction_pointer++];
             char mod = instr_2 >> 6;
             char instr_index = (instr_2 >> 3) & 7;
             char r_m = instr_2 & 7;
@@ -548,96 +947,993 @@ int main(int argc, char **argv)
 
             char *to = malloc(20);
 
-            int disp = create_mem_reg_str(file, mod, r_m, w, to);
+            int disp = create_mem_reg_str(m, mod, r_m, w, to);
 
-            u_int16_t data = get_num_from_file(w, s, file);
+            u_int16_t data = get_num_from_file(m, w, s);
 
-            perform_instruction_reg(instr_index, r_m, data);
+            if (mod == 3)
+            {
+                perform_instruction_reg(m, instr_index, reg_lookup_table[w][r_m], data);
+            }
+            else
+            {
+                perform_instruction_mem(m, instr_index, operand_address(m, r_m, mod, disp), data, w);
+            }
 
-            printf("%s %s, %d\n", instr_name, to, data);
+            sprintf(m->instruction_text, "%s %s, %d", instr_name, to, data);
             free(to);
 
             if (mod == 3)
             {
-                num_cycles += 4;
+                m->num_cycles += 4;
             }
             else
             {
-                calc_effective_address_cycles(r_m, mod, disp);
-                num_cycles += 17;
+                calc_effective_address_cycles(m, r_m, mod, disp);
+                m->num_cycles += 17;
             }
         }
         else if (instr_1 >> 6 == 0 && ((instr_1 >> 1) & 3) == 2) // accumulator ADD, SUB, CMP, etc.
         {
+            opcode_class = OP_ARITH_IMM_ACC;
             bool w = instr_1 & 1;
             char instr_idx = (instr_1 >> 3) & 7;
             char *instr_name = arith_instr[instr_idx];
 
-            int data = get_num_from_file(w, false, file);
+            int data = get_num_from_file(m, w, false);
 
-            struct Register acc;
-            if (w)
-            {
-                acc = reg_lookup_table[1][0];
-            }
-            else
-            {
-                acc = reg_lookup_table[0][0];
-            }
+            struct Register acc = reg_lookup_table[w][0];
 
-            perform_instruction_reg(instr_idx, acc.memory_index, data);
+            perform_instruction_reg(m, instr_idx, acc, data);
 
-            printf("%s %s, %d\n", instr_name, acc.name, data);
+            sprintf(m->instruction_text, "%s %s, %d", instr_name, acc.name, data);
 
-            num_cycles += 4;
+            m->num_cycles += 4;
         }
         else if (instr_1 >> 4 == 7) // JUMP commands
         {
+            opcode_class = OP_JUMP;
             char instr_index = instr_1 & 15;
             char *instr_name = jump_commands[instr_index];
 
-            int data = get_num_from_file(false, false, file);
+            int data = get_num_from_file(m, false, false);
 
-            switch (instr_index)
-            {
-            case 5: // jne
+            // 8086 timings: 16 cycles taken, 4 not taken.
+            if (jump_condition(&m->flags, instr_index))
             {
-                if (!zero_flag)
-                {
-                    instruction_pointer += data;
-                }
-                break;
+                m->instruction_pointer += data;
+                m->num_cycles += 16;
             }
+            else
+            {
+                m->num_cycles += 4;
             }
 
-            printf("%s %d\n", instr_name, data);
+            sprintf(m->instruction_text, "%s %d", instr_name, data);
         }
         else if (instr_1 >> 4 == 0xE && (instr_1 & 15) < 4) // Other in jump
         {
+            opcode_class = OP_LOOP;
             char instr_index = instr_1 & 3;
             char *instr_name = other_comp_commands[instr_index];
 
-            int data = get_num_from_file(false, false, file);
+            int data = get_num_from_file(m, false, false);
+
+            bool taken;
+            if (instr_index == 3) // jcxz
+            {
+                taken = m->register_mem[1] == 0;
+            }
+            else
+            {
+                m->register_mem[1] -= 1;
+                taken = m->register_mem[1] != 0;
+                if (instr_index == 0) // loopnz
+                {
+                    taken = taken && !flag_set(&m->flags, FLAG_ZF);
+                }
+                else if (instr_index == 1) // loopz
+                {
+                    taken = taken && flag_set(&m->flags, FLAG_ZF);
+                }
+            }
+
+            // 8086 taken/not-taken cycles, indexed like other_comp_commands.
+            static const u_int8_t taken_cycles[4] = {19, 18, 17, 18};
+            static const u_int8_t not_taken_cycles[4] = {5, 6, 5, 6};
+            if (taken)
+            {
+                m->instruction_pointer += data;
+                m->num_cycles += taken_cycles[(int)instr_index];
+            }
+            else
+            {
+                m->num_cycles += not_taken_cycles[(int)instr_index];
+            }
 
-            printf("%s %d\n", instr_name, data);
+            sprintf(m->instruction_text, "%s %d", instr_name, data);
         }
         else
         {
-            printf("unrecognized pattern %d\n", instr_1);
+            sprintf(m->instruction_text, "unrecognized pattern %d", instr_1);
+        }
+
+        if (verbose)
+        {
+            printf("%s\n", m->instruction_text);
+        }
+        if (m->profile)
+        {
+            record_instruction(m, instruction_address, opcode_class, m->num_cycles - instruction_start_cycles);
         }
     }
+}
 
+void print_machine_state(struct Machine *m)
+{
     for (int i = 0; i < 8; ++i)
     {
-        printf("%s: %d\n", reg_lookup_table[1][i].name, register_mem[i]);
+        printf("%s: %d\n", reg_lookup_table[1][i].name, m->register_mem[i]);
     }
 
-    printf("INSTRUCTION POINTER: %d\n", instruction_pointer);
+    printf("INSTRUCTION POINTER: %d\n", m->instruction_pointer);
 
-    printf("SIGNED FLAG: %d\n", sign_flag);
-    printf("ZERO FLAG: %d\n", zero_flag);
-    printf("CYCLES ELAPSED: %d\n", num_cycles);
+    u_int16_t flags = flag_bits(&m->flags);
+    printf("SIGNED FLAG: %d\n", (flags & FLAG_SF) != 0);
+    printf("ZERO FLAG: %d\n", (flags & FLAG_ZF) != 0);
+    printf("CARRY FLAG: %d\n", (flags & FLAG_CF) != 0);
+    printf("OVERFLOW FLAG: %d\n", (flags & FLAG_OF) != 0);
+    printf("PARITY FLAG: %d\n", (flags & FLAG_PF) != 0);
+    printf("AUXILIARY FLAG: %d\n", (flags & FLAG_AF) != 0);
+    printf("CYCLES ELAPSED: %zu\n", m->num_cycles);
+}
 
-    fclose(file);
-    return 0;
-}
\ No newline at end of file
+// Snapshots hold the CPU state plus only the memory pages that differ from
+// their base snapshot (or from zeroed memory when there is no base), so many
+// variants can fork from one warmed-up state and share its pages.
+struct MachineSnapshot
+{
+    u_int16_t register_mem[8];
+    u_int16_t instruction_pointer;
+    u_int32_t instruction_size;
+    struct LazyFlags flags;
+    size_t num_cycles;
+
+    const struct MachineSnapshot *base;
+    u_int64_t page_mask[SNAPSHOT_PAGE_COUNT / 64];
+    u_int8_t page_slot[SNAPSHOT_PAGE_COUNT];
+    u_int32_t page_count;
+    u_int8_t (*pages)[SNAPSHOT_PAGE_SIZE];
+};
+
+// Snapshot files are little-endian with no padding, field by field: magic
+// "S863", registers (8 x u16), instruction pointer (u16), instruction size
+// (u32), lazy flags (a, b, result as u16; op, wide, carry_in as u8), cycles
+// (u64), page mask (u64 each), then the contents of every page in the mask.
+#define SNAPSHOT_HEADER_SIZE (4 + 8 * 2 + 2 + 4 + 3 * 2 + 3 + 8 + SNAPSHOT_PAGE_COUNT / 64 * 8)
+
+void put_le(u_int8_t **out, u_int64_t value, int size)
+{
+    for (int i = 0; i < size; ++i)
+    {
+        *(*out)++ = (u_int8_t)(value >> (8 * i));
+    }
+}
+
+u_int64_t get_le(const u_int8_t **in, int size)
+{
+    u_int64_t value = 0;
+    for (int i = 0; i < size; ++i)
+    {
+        value |= (u_int64_t)*(*in)++ << (8 * i);
+    }
+    return value;
+}
+
+u_int8_t zero_page[SNAPSHOT_PAGE_SIZE];
+
+bool page_bit(const u_int64_t *mask, int page)
+{
+    return (mask[page / 64] >> (page % 64)) & 1;
+}
+
+const u_int8_t *snapshot_page(const struct MachineSnapshot *s, int page)
+{
+    for (; s; s = s->base)
+    {
+        if (page_bit(s->page_mask, page))
+        {
+            return s->pages[s->page_slot[page]];
+        }
+    }
+    return zero_page;
+}
+
+struct MachineSnapshot *allocate_snapshot(u_int64_t *page_mask)
+{
+    struct MachineSnapshot *s = calloc(1, sizeof(struct MachineSnapshot));
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        if (page_bit(page_mask, page))
+        {
+            s->page_mask[page / 64] |= 1ull << (page % 64);
+            s->page_slot[page] = s->page_count++;
+        }
+    }
+    s->pages = malloc((s->page_count ? s->page_count : 1) * SNAPSHOT_PAGE_SIZE);
+    return s;
+}
+
+// Captures the machine. When the machine descends from base, only pages it has
+// dirtied and whose contents actually changed are stored; the rest are shared.
+struct MachineSnapshot *take_snapshot(struct Machine *m, const struct MachineSnapshot *base)
+{
+    bool diff = base && m->snapshot_origin == base;
+
+    u_int64_t page_mask[SNAPSHOT_PAGE_COUNT / 64] = {0};
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        const u_int8_t *data = &m->program_memory[page * SNAPSHOT_PAGE_SIZE];
+        bool store;
+        if (diff)
+        {
+            store = page_bit(m->dirty_pages, page) && memcmp(data, snapshot_page(base, page), SNAPSHOT_PAGE_SIZE) != 0;
+        }
+        else
+        {
+            store = memcmp(data, zero_page, SNAPSHOT_PAGE_SIZE) != 0;
+        }
+
+        if (store)
+        {
+            page_mask[page / 64] |= 1ull << (page % 64);
+        }
+    }
+
+    struct MachineSnapshot *s = allocate_snapshot(page_mask);
+    memcpy(s->register_mem, m->register_mem, sizeof(s->register_mem));
+    s->instruction_pointer = m->instruction_pointer;
+    s->instruction_size = m->instruction_size;
+    s->flags = m->flags;
+    s->num_cycles = m->num_cycles;
+    s->base = diff ? base : NULL;
+
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        if (page_bit(s->page_mask, page))
+        {
+            memcpy(s->pages[s->page_slot[page]], &m->program_memory[page * SNAPSHOT_PAGE_SIZE], SNAPSHOT_PAGE_SIZE);
+        }
+    }
+
+    m->snapshot_origin = s;
+    memset(m->dirty_pages, 0, sizeof(m->dirty_pages));
+    return s;
+}
+
+// Puts the machine back into the state of s. If the machine still descends
+// from s, only the pages written since then are copied back. Returns the
+// number of pages copied.
+int restore_snapshot(struct Machine *m, const struct MachineSnapshot *s)
+{
+    u_int64_t copy_mask[SNAPSHOT_PAGE_COUNT / 64];
+    memcpy(copy_mask, m->dirty_pages, sizeof(copy_mask));
+
+    bool incremental = false;
+    for (const struct MachineSnapshot *origin = m->snapshot_origin; origin; origin = origin->base)
+    {
+        if (origin == s)
+        {
+            incremental = true;
+            break;
+        }
+        for (int i = 0; i < SNAPSHOT_PAGE_COUNT / 64; ++i)
+        {
+            copy_mask[i] |= origin->page_mask[i];
+        }
+    }
+
+    int pages_copied = 0;
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        if (incremental && !page_bit(copy_mask, page))
+        {
+            continue;
+        }
+        memcpy(&m->program_memory[page * SNAPSHOT_PAGE_SIZE], snapshot_page(s, page), SNAPSHOT_PAGE_SIZE);
+        pages_copied++;
+    }
+
+    memcpy(m->register_mem, s->register_mem, sizeof(m->register_mem));
+    m->instruction_pointer = s->instruction_pointer;
+    m->instruction_size = s->instruction_size;
+    m->flags = s->flags;
+    m->num_cycles = s->num_cycles;
+
+    m->snapshot_origin = s;
+    memset(m->dirty_pages, 0, sizeof(m->dirty_pages));
+    return pages_copied;
+}
+
+void free_snapshot(struct MachineSnapshot *s)
+{
+    free(s->pages);
+    free(s);
+}
+
+// Files always hold a flattened snapshot: every non-zero page, no base.
+bool write_snapshot(const struct MachineSnapshot *s, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    u_int64_t page_mask[SNAPSHOT_PAGE_COUNT / 64] = {0};
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        if (snapshot_page(s, page) != zero_page)
+        {
+            page_mask[page / 64] |= 1ull << (page % 64);
+        }
+    }
+
+    u_int8_t header[SNAPSHOT_HEADER_SIZE];
+    u_int8_t *out = header;
+    memcpy(out, "S863", 4);
+    out += 4;
+    for (int i = 0; i < 8; ++i)
+    {
+        put_le(&out, s->register_mem[i], 2);
+    }
+    put_le(&out, s->instruction_pointer, 2);
+    put_le(&out, s->instruction_size, 4);
+    put_le(&out, s->flags.a, 2);
+    put_le(&out, s->flags.b, 2);
+    put_le(&out, s->flags.result, 2);
+    put_le(&out, s->flags.op, 1);
+    put_le(&out, s->flags.wide, 1);
+    put_le(&out, s->flags.carry_in, 1);
+    put_le(&out, s->num_cycles, 8);
+    for (int i = 0; i < SNAPSHOT_PAGE_COUNT / 64; ++i)
+    {
+        put_le(&out, page_mask[i], 8);
+    }
+
+    fwrite(header, sizeof(header), 1, file);
+    for (int page = 0; page < SNAPSHOT_PAGE_COUNT; ++page)
+    {
+        if (page_bit(page_mask, page))
+        {
+            fwrite(snapshot_page(s, page), SNAPSHOT_PAGE_SIZE, 1, file);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+struct MachineSnapshot *read_snapshot(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    u_int8_t header[SNAPSHOT_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, "S863", 4) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    const u_int8_t *in = header + 4;
+    u_int16_t register_mem[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        register_mem[i] = get_le(&in, 2);
+    }
+    u_int16_t instruction_pointer = get_le(&in, 2);
+    u_int32_t instruction_size = get_le(&in, 4);
+    struct LazyFlags flags = {0};
+    flags.a = get_le(&in, 2);
+    flags.b = get_le(&in, 2);
+    flags.result = get_le(&in, 2);
+    flags.op = get_le(&in, 1);
+    flags.wide = get_le(&in, 1);
+    flags.carry_in = get_le(&in, 1);
+    u_int64_t num_cycles = get_le(&in, 8);
+    u_int64_t page_mask[SNAPSHOT_PAGE_COUNT / 64];
+    for (int i = 0; i < SNAPSHOT_PAGE_COUNT / 64; ++i)
+    {
+        page_mask[i] = get_le(&in, 8);
+    }
+
+    struct MachineSnapshot *s = allocate_snapshot(page_mask);
+    memcpy(s->register_mem, register_mem, sizeof(s->register_mem));
+    s->instruction_pointer = instruction_pointer;
+    s->instruction_size = instruction_size;
+    s->flags = flags;
+    s->num_cycles = num_cycles;
+
+    size_t pages_read = fread(s->pages, SNAPSHOT_PAGE_SIZE, s->page_count, file);
+    fclose(file);
+    if (pages_read != s->page_count)
+    {
+        free_snapshot(s);
+        return NULL;
+    }
+    return s;
+}
+
+#define MAX_TRACE_CACHES 4
+
+// Replays the recorded trace through each configured cache/TLB and reports
+// hit rates and reuse distances.
+void analyze_memory_trace(struct MemoryTrace *trace, struct CacheConfig *caches, int cache_count,
+                          const char *trace_out)
+{
+    u_int64_t reads = 0;
+    u_int64_t bytes = 0;
+    for (size_t i = 0; i < trace->count; ++i)
+    {
+        reads += !trace->accesses[i].write;
+        bytes += trace->accesses[i].size;
+    }
+
+    printf("\nMEMORY TRACE: %zu accesses (%llu reads, %llu writes), %llu bytes\n", trace->count,
+           (unsigned long long)reads, (unsigned long long)(trace->count - reads), (unsigned long long)bytes);
+
+    if (trace_out)
+    {
+        FILE *file = fopen(trace_out, "w");
+        if (file)
+        {
+            for (size_t i = 0; i < trace->count; ++i)
+            {
+                struct MemoryAccess *access = &trace->accesses[i];
+                fprintf(file, "%c 0x%04x %u\n", access->write ? 'W' : 'R', access->address, access->size);
+            }
+            fclose(file);
+        }
+        else
+        {
+            printf("Error writing trace %s\n", trace_out);
+        }
+    }
+
+    // Reuse distance is measured in each configuration's own lines (or pages);
+    // without any configuration, in 64B lines.
+    struct CacheConfig default_config = {"CACHE", false, 65536, 1, 64, POLICY_LRU};
+    struct CacheConfig *configs = cache_count ? caches : &default_config;
+    int config_count = cache_count ? cache_count : 1;
+
+    struct CacheSim sims[MAX_TRACE_CACHES];
+    struct ReuseDistance reuse[MAX_TRACE_CACHES];
+    for (int i = 0; i < config_count; ++i)
+    {
+        init_cache(&sims[i], configs[i]);
+        init_reuse_distance(&reuse[i], configs[i].line_size);
+    }
+
+    for (size_t i = 0; i < trace->count; ++i)
+    {
+        // The address space wraps: a word at 0xFFFF is 0xFFFF and 0x0000.
+        struct MemoryAccess *access = &trace->accesses[i];
+        u_int32_t size = access->size;
+        u_int32_t wrapped = 0;
+        if (access->address + size > 65536)
+        {
+            size = 65536 - access->address;
+            wrapped = access->size - size;
+        }
+        for (int c = 0; c < config_count; ++c)
+        {
+            cache_access(&sims[c], access->address, size);
+            reuse_access(&reuse[c], access->address, size);
+            if (wrapped)
+            {
+                cache_access(&sims[c], 0, wrapped);
+                reuse_access(&reuse[c], 0, wrapped);
+            }
+        }
+    }
+
+    for (int i = 0; i < config_count; ++i)
+    {
+        if (cache_count)
+        {
+            print_cache_stats(&sims[i]);
+        }
+        print_reuse_distance(&reuse[i], configs[i].tlb ? "pages" : "lines");
+        free_cache(&sims[i]);
+        free_reuse_distance(&reuse[i]);
+    }
+}
+
+double elapsed_us(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000.0 + (end->tv_nsec - start->tv_nsec) / 1000.0;
+}
+
+// Forks one variant per value from the machine's current (warmed-up) state,
+// with the word at address set to that value, and runs each to the end.
+void run_sweep(struct Machine *m, u_int16_t address, int first, int last, int step)
+{
+    struct MachineSnapshot *warm = take_snapshot(m, NULL);
+    m->break_address = -1;
+
+    int variants = 0;
+    u_int64_t pages_copied = 0;
+    u_int64_t pages_stored = 0;
+    double restore_time = 0;
+
+    for (int value = first; step > 0 ? value <= last : value >= last; value += step)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pages_copied += restore_snapshot(m, warm);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        restore_time += elapsed_us(&start, &end);
+
+        m->program_memory[address] = value & 0xFF;
+        m->program_memory[(u_int16_t)(address + 1)] = (value >> 8) & 0xFF;
+        mark_dirty(m, address);
+        mark_dirty(m, address + 1);
+
+        simulate(m, false);
+
+        struct MachineSnapshot *variant = take_snapshot(m, warm);
+        pages_stored += variant->page_count;
+
+        printf("[%d] = %d:", address, value);
+        for (int i = 0; i < 8; ++i)
+        {
+            printf(" %s=%d", reg_lookup_table[1][i].name, m->register_mem[i]);
+        }
+        printf(" flags=0x%04x cycles=%zu\n", flag_bits(&m->flags), m->num_cycles);
+
+        // The machine now descends from variant. Point it back at warm, with
+        // the variant's private pages as the ones to restore, before freeing.
+        m->snapshot_origin = warm;
+        memcpy(m->dirty_pages, variant->page_mask, sizeof(m->dirty_pages));
+        free_snapshot(variant);
+        variants++;
+    }
+
+    if (variants)
+    {
+        printf("%d variants forked from %u shared pages: avg restore %.2fus (%.1f pages), avg %.1f private pages each\n",
+               variants, warm->page_count, restore_time / variants, (double)pages_copied / variants,
+               (double)pages_stored / variants);
+    }
+    free_snapshot(warm);
+}
+
+// Batch mode: a manifest lists one listing per line, optionally followed by
+// the path of its expected final state (default: <listing>.expected). The
+// expected file uses the same "name: value" lines print_machine_state writes,
+// and only the fields it mentions are checked; it must mention at least one.
+// A listing still running after the step limit fails as a timeout.
+#define STATE_FIELD_COUNT 16
+#define BATCH_STEP_LIMIT 10000000
+
+const char *state_field_names[STATE_FIELD_COUNT] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "INSTRUCTION POINTER", "SIGNED FLAG", "ZERO FLAG", "CARRY FLAG",
+    "OVERFLOW FLAG", "PARITY FLAG", "AUXILIARY FLAG", "CYCLES ELAPSED"};
+
+#define BATCH_PATH_SIZE 256
+
+struct BatchJob
+{
+    char listing[BATCH_PATH_SIZE];
+    char expected[BATCH_PATH_SIZE + 16]; // room for <listing>.expected
+    bool passed;
+    size_t num_cycles;
+    char failure[BATCH_PATH_SIZE + 64]; // room for a message naming expected
+};
+
+struct Batch
+{
+    struct BatchJob *jobs;
+    int job_count;
+    size_t step_limit;
+    atomic_int next_job;
+};
+
+long machine_state_field(struct Machine *m, int field)
+{
+    if (field < 8)
+    {
+        return m->register_mem[field];
+    }
+
+    switch (field)
+    {
+    case 8:
+        return m->instruction_pointer;
+    case 9:
+        return flag_set(&m->flags, FLAG_SF);
+    case 10:
+        return flag_set(&m->flags, FLAG_ZF);
+    case 11:
+        return flag_set(&m->flags, FLAG_CF);
+    case 12:
+        return flag_set(&m->flags, FLAG_OF);
+    case 13:
+        return flag_set(&m->flags, FLAG_PF);
+    case 14:
+        return flag_set(&m->flags, FLAG_AF);
+    default:
+        return m->num_cycles;
+    }
+}
+
+void run_batch_job(struct Machine *m, struct BatchJob *job, size_t step_limit)
+{
+    memset(m, 0, sizeof(*m));
+    job->passed = false;
+
+    const char *error = load_program(m, job->listing);
+    if (error)
+    {
+        snprintf(job->failure, sizeof(job->failure), "%s", error);
+        return;
+    }
+
+    FILE *expected = fopen(job->expected, "r");
+    if (expected == NULL)
+    {
+        snprintf(job->failure, sizeof(job->failure), "cannot open expected state %s", job->expected);
+        return;
+    }
+
+    m->step_limit = step_limit;
+    simulate(m, false);
+    job->num_cycles = m->num_cycles;
+    if (m->instruction_pointer < m->instruction_size)
+    {
+        snprintf(job->failure, sizeof(job->failure), "timed out after %zu instructions", step_limit);
+        fclose(expected);
+        return;
+    }
+
+    int failure_len = 0;
+    int checked = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), expected))
+    {
+        char *separator = strstr(line, ": ");
+        if (separator == NULL)
+        {
+            continue;
+        }
+        *separator = '\0';
+
+        for (int field = 0; field < STATE_FIELD_COUNT; ++field)
+        {
+            if (strcmp(line, state_field_names[field]) != 0)
+            {
+                continue;
+            }
+
+            checked++;
+            long want = atol(separator + 2);
+            long got = machine_state_field(m, field);
+            if (want != got && failure_len < (int)sizeof(job->failure))
+            {
+                failure_len += snprintf(job->failure + failure_len, sizeof(job->failure) - failure_len,
+                                        "%s expected %ld got %ld; ", line, want, got);
+            }
+        }
+    }
+    fclose(expected);
+
+    if (checked == 0)
+    {
+        snprintf(job->failure, sizeof(job->failure), "%s names no machine state fields", job->expected);
+        return;
+    }
+    job->passed = failure_len == 0;
+}
+
+void *batch_worker(void *arg)
+{
+    struct Batch *batch = arg;
+    struct Machine *m = malloc(sizeof(struct Machine));
+
+    for (;;)
+    {
+        int index = atomic_fetch_add(&batch->next_job, 1);
+        if (index >= batch->job_count)
+        {
+            break;
+        }
+        run_batch_job(m, &batch->jobs[index], batch->step_limit);
+    }
+
+    free(m);
+    return NULL;
+}
+
+int run_batch(const char *manifest_name, int thread_count, size_t step_limit)
+{
+    FILE *manifest = fopen(manifest_name, "r");
+    if (manifest == NULL)
+    {
+        printf("Error opening manifest %s\n", manifest_name);
+        return 1;
+    }
+
+    struct Batch batch = {0};
+    batch.step_limit = step_limit;
+    int job_capacity = 0;
+    char line[600];
+    while (fgets(line, sizeof(line), manifest))
+    {
+        char listing[BATCH_PATH_SIZE];
+        char expected[BATCH_PATH_SIZE];
+        int fields = sscanf(line, "%255s %255s", listing, expected);
+        if (fields < 1 || listing[0] == '#')
+        {
+            continue;
+        }
+
+        if (batch.job_count == job_capacity)
+        {
+            job_capacity = job_capacity ? job_capacity * 2 : 64;
+            batch.jobs = realloc(batch.jobs, job_capacity * sizeof(struct BatchJob));
+        }
+
+        struct BatchJob *job = &batch.jobs[batch.job_count++];
+        memset(job, 0, sizeof(*job));
+        snprintf(job->listing, sizeof(job->listing), "%s", listing);
+        if (fields == 2)
+        {
+            snprintf(job->expected, sizeof(job->expected), "%s", expected);
+        }
+        else
+        {
+            snprintf(job->expected, sizeof(job->expected), "%s.expected", listing);
+        }
+    }
+    fclose(manifest);
+
+    if (thread_count <= 0)
+    {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_count > batch.job_count)
+    {
+        thread_count = batch.job_count > 0 ? batch.job_count : 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    atomic_init(&batch.next_job, 0);
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_create(&threads[i], NULL, batch_worker, &batch);
+    }
+    for (int i = 0; i < thread_count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int passed = 0;
+    for (int i = 0; i < batch.job_count; ++i)
+    {
+        struct BatchJob *job = &batch.jobs[i];
+        if (job->passed)
+        {
+            passed++;
+            printf("PASS %s (%zu cycles)\n", job->listing, job->num_cycles);
+        }
+        else
+        {
+            printf("FAIL %s: %s\n", job->listing, job->failure);
+        }
+    }
+
+    double elapsed_ms = elapsed_us(&start, &end) / 1000.0;
+    printf("%d/%d listings passed in %.2fms on %d threads\n", passed, batch.job_count, elapsed_ms, thread_count);
+
+    free(batch.jobs);
+    return passed == batch.job_count ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+
+    // File handling
+    char *filename = NULL;
+    char *manifest = NULL;
+    bool profile = false;
+    int thread_count = 0;
+    size_t step_limit = BATCH_STEP_LIMIT;
+    char *save_snapshot = NULL;
+    char *load_snapshot = NULL;
+    int break_address = -1;
+    char *sweep = NULL;
+    bool trace_memory = false;
+    char *trace_out = NULL;
+    struct CacheConfig caches[MAX_TRACE_CACHES];
+    int cache_count = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-profile") == 0)
+        {
+            profile = true;
+        }
+        else if (strcmp(argv[i], "-top") == 0 && i + 1 < argc)
+        {
+            profile_top_n = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+        {
+            manifest = argv[++i];
+        }
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+        {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc)
+        {
+            step_limit = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-save-snapshot") == 0 && i + 1 < argc)
+        {
+            save_snapshot = argv[++i];
+        }
+        else if (strcmp(argv[i], "-load-snapshot") == 0 && i + 1 < argc)
+        {
+            load_snapshot = argv[++i];
+        }
+        else if (strcmp(argv[i], "-break") == 0 && i + 1 < argc)
+        {
+            break_address = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-sweep") == 0 && i + 1 < argc)
+        {
+            sweep = argv[++i];
+        }
+        else if (strcmp(argv[i], "-trace-mem") == 0)
+        {
+            trace_memory = true;
+        }
+        else if (strcmp(argv[i], "-trace-out") == 0 && i + 1 < argc)
+        {
+            trace_memory = true;
+            trace_out = argv[++i];
+        }
+        else if ((strcmp(argv[i], "-cache") == 0 || strcmp(argv[i], "-tlb") == 0) && i + 1 < argc)
+        {
+            bool tlb = argv[i][1] == 't';
+            if (cache_count == MAX_TRACE_CACHES ||
+                !parse_cache_config(argv[i + 1], tlb ? "TLB" : "CACHE", tlb, &caches[cache_count]))
+            {
+                printf("Bad %s %s, expected %s:WAYS:%s[:lru|fifo|random] (at most %d)\n", argv[i], argv[i + 1],
+                       tlb ? "ENTRIES" : "SIZE", tlb ? "PAGE" : "LINE", MAX_TRACE_CACHES);
+                exit(1);
+            }
+            trace_memory = true;
+            cache_count++;
+            i++;
+        }
+        else if (filename == NULL)
+        {
+            filename = argv[i];
+        }
+        else
+        {
+            filename = NULL;
+            break;
+        }
+    }
+
+    if (manifest)
+    {
+        return run_batch(manifest, thread_count, step_limit);
+    }
+
+    if (filename == NULL && load_snapshot == NULL)
+    {
+        printf("Wrong number of arguments!\n");
+        printf("Usage: %s [-profile] [-top N] [-break ADDR] [-save-snapshot FILE] [filename]\n", argv[0]);
+        printf("       %s [-trace-mem] [-trace-out FILE] [-cache SIZE:WAYS:LINE[:POLICY]] [-tlb ENTRIES:WAYS:PAGE[:POLICY]] [filename]\n", argv[0]);
+        printf("       %s -load-snapshot FILE [-profile] [-top N] [-save-snapshot FILE]\n", argv[0]);
+        printf("       %s -sweep ADDR:FIRST:LAST[:STEP] [-break ADDR] [filename]\n", argv[0]);
+        printf("       %s -batch [manifest] [-threads N] [-steps N]\n", argv[0]);
+        exit(1);
+    }
+
+    static struct Machine machine;
+    struct Machine *m = &machine;
+
+    struct MachineSnapshot *loaded = NULL;
+    if (load_snapshot)
+    {
+        loaded = read_snapshot(load_snapshot);
+        if (loaded == NULL)
+        {
+            printf("Error reading snapshot %s\n", load_snapshot);
+            exit(1);
+        }
+        restore_snapshot(m, loaded);
+    }
+    else
+    {
+        const char *error = load_program(m, filename);
+        if (error)
+        {
+            printf("%s\n", error);
+            exit(1);
+        }
+    }
+    m->break_address = break_address;
+
+    if (sweep)
+    {
+        int address, first, last, step = 1;
+        if (sscanf(sweep, "%d:%d:%d:%d", &address, &first, &last, &step) < 3 || step == 0)
+        {
+            printf("Bad sweep %s, expected ADDR:FIRST:LAST[:STEP]\n", sweep);
+            exit(1);
+        }
+
+        // Warm up to the break address (or the end), then fork from there.
+        simulate(m, false);
+        run_sweep(m, address, first, last, step);
+        return 0;
+    }
+
+    if (profile)
+    {
+        m->profile = calloc(1, sizeof(struct MachineProfile));
+    }
+    if (trace_memory)
+    {
+        m->trace = calloc(1, sizeof(struct MemoryTrace));
+    }
+
+    simulate(m, true);
+    print_machine_state(m);
+
+    if (m->profile)
+    {
+        print_profile(m);
+        free(m->profile);
+    }
+
+    if (m->trace)
+    {
+        analyze_memory_trace(m->trace, caches, cache_count, trace_out);
+        free(m->trace->accesses);
+        free(m->trace);
+    }
+
+    if (save_snapshot)
+    {
+        struct MachineSnapshot *snapshot = take_snapshot(m, NULL);
+        if (!write_snapshot(snapshot, save_snapshot))
+        {
+            printf("Error writing snapshot %s\n", save_snapshot);
+        }
+        free_snapshot(snapshot);
+    }
+
+    if (loaded)
+    {
+        free_snapshot(loaded);
+    }
+
+    return 0;
+}
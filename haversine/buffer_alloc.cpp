@@ -0,0 +1,292 @@
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// Large buffers (the file image and the pair array) come from here instead
+// of new[], so they can be placed on a NUMA node or interleaved across nodes,
+// backed by huge pages, and pre-faulted by several threads. Memory is mapped
+// anonymously and therefore starts zeroed. All of this is Linux-only; other
+// platforms get plain mappings and the options are ignored.
+
+enum class Placement {
+  FIRST_TOUCH, // no policy: pages land on the node of the thread touching them
+  NODE,
+  INTERLEAVE,
+};
+
+enum class PageMode {
+  NORMAL,
+  TRANSPARENT, // madvise(MADV_HUGEPAGE)
+  EXPLICIT,    // MAP_HUGETLB from the preallocated pool
+};
+
+struct BufferOptions {
+  Placement placement;
+  int node;
+  PageMode pages;
+
+  // When non-zero, this many threads touch the buffer before it is returned.
+  // Each takes every prefault_threads-th stripe of prefault_stripe bytes, the
+  // same interleaving the reduction workers use, so first-touch placement puts
+  // each stripe on the node of the thread that will read it.
+  u32 prefault_threads;
+  size_t prefault_stripe;
+};
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAX_LIVE_BUFFERS 64
+#define MAX_NODES 64 // node masks are one u64
+
+struct LiveBuffer {
+  void *base;
+  size_t size;
+  PageMode pages; // what the mapping got, after any hugetlb fallback
+  bool committed; // alloc_buffer rather than reserve_buffer
+};
+
+// Mapping sizes for free_buffer, so callers only keep the pointer.
+static LiveBuffer live_buffers[MAX_LIVE_BUFFERS];
+
+static inline const char *placement_name(Placement placement) {
+  switch (placement) {
+  case Placement::NODE:
+    return "node";
+  case Placement::INTERLEAVE:
+    return "interleave";
+  default:
+    return "first-touch";
+  }
+}
+
+static inline const char *page_mode_name(PageMode pages) {
+  switch (pages) {
+  case PageMode::TRANSPARENT:
+    return "thp";
+  case PageMode::EXPLICIT:
+    return "hugetlb";
+  default:
+    return "4k";
+  }
+}
+
+// Parses "first-touch", "interleave" or a node number below MAX_NODES.
+static inline bool parse_placement(const char *text, BufferOptions *options) {
+  if (strcmp(text, "first-touch") == 0) {
+    options->placement = Placement::FIRST_TOUCH;
+  } else if (strcmp(text, "interleave") == 0) {
+    options->placement = Placement::INTERLEAVE;
+  } else if (text[0] >= '0' && text[0] <= '9' && atoi(text) < MAX_NODES) {
+    options->placement = Placement::NODE;
+    options->node = atoi(text);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static inline bool parse_page_mode(const char *text, BufferOptions *options) {
+  if (strcmp(text, "4k") == 0) {
+    options->pages = PageMode::NORMAL;
+  } else if (strcmp(text, "thp") == 0) {
+    options->pages = PageMode::TRANSPARENT;
+  } else if (strcmp(text, "hugetlb") == 0) {
+    options->pages = PageMode::EXPLICIT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#if defined(__linux__)
+#define MPOL_BIND_MODE 2
+#define MPOL_INTERLEAVE_MODE 3
+
+// Online nodes as a bitmask, from /sys ("0-1", "0,2-3", ...).
+static u64 online_node_mask() {
+  u64 mask = 0;
+  FILE *file = fopen("/sys/devices/system/node/online", "r");
+  if (!file) {
+    return 1;
+  }
+  int first, last;
+  while (fscanf(file, "%d", &first) == 1) {
+    last = first;
+    int next = fgetc(file);
+    if (next == '-') {
+      fscanf(file, "%d", &last);
+      next = fgetc(file);
+    }
+    for (int node = first; node <= last && node < MAX_NODES; ++node) {
+      mask |= 1ull << node;
+    }
+    if (next != ',') {
+      break;
+    }
+  }
+  fclose(file);
+  return mask ? mask : 1;
+}
+
+static bool apply_placement(void *base, size_t size, BufferOptions *options) {
+  if (options->placement == Placement::FIRST_TOUCH) {
+    return true;
+  }
+  u64 mask = options->placement == Placement::NODE ? 1ull << options->node
+                                                   : online_node_mask();
+  int mode = options->placement == Placement::NODE ? MPOL_BIND_MODE
+                                                   : MPOL_INTERLEAVE_MODE;
+  return syscall(SYS_mbind, base, size, mode, &mask, MAX_NODES, 0) == 0;
+}
+#endif
+
+static void touch_stripes(char *base, size_t size, size_t stripe, u32 first,
+                          u32 stride) {
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t start = first * stripe; start < size; start += stride * stripe) {
+    size_t end = start + stripe < size ? start + stripe : size;
+    for (size_t offset = start; offset < end; offset += page) {
+      base[offset] = 0;
+    }
+  }
+}
+
+// Records a mapping for free_buffer. Running out of slots would leak it, so
+// that is fatal rather than silent.
+static void track_buffer(void *base, size_t size, PageMode pages,
+                         bool committed) {
+  for (int i = 0; i < MAX_LIVE_BUFFERS; ++i) {
+    if (!live_buffers[i].base) {
+      live_buffers[i] = {base, size, pages, committed};
+      return;
+    }
+  }
+  fprintf(stderr, "More than %d live buffers\n", MAX_LIVE_BUFFERS);
+  exit(1);
+}
+
+static void prefault_buffer(char *base, size_t size, BufferOptions *options) {
+  TRACE_BANDWIDTH("prefault", size);
+
+  u32 thread_count = options->prefault_threads;
+  size_t stripe =
+      options->prefault_stripe ? options->prefault_stripe : HUGE_PAGE_SIZE;
+  std::thread *workers = new std::thread[thread_count - 1];
+  for (u32 t = 1; t < thread_count; ++t) {
+    workers[t - 1] =
+        std::thread(touch_stripes, base, size, stripe, t, thread_count);
+  }
+  touch_stripes(base, size, stripe, 0, thread_count);
+  for (u32 t = 1; t < thread_count; ++t) {
+    workers[t - 1].join();
+  }
+  delete[] workers;
+}
+
+static void *map_buffer(size_t *mapped_size, BufferOptions *options) {
+  TRACE_BLOCK("alloc_buffer");
+
+  size_t size = *mapped_size ? *mapped_size : 1;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *base = MAP_FAILED;
+  PageMode pages = options->pages;
+
+#if defined(__linux__)
+  if (options->pages == PageMode::EXPLICIT) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1,
+                0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "No hugetlb pages available, using 4k pages\n");
+      pages = PageMode::NORMAL;
+    }
+  }
+#endif
+  if (base == MAP_FAILED) {
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  }
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %zu bytes\n", size);
+    exit(1);
+  }
+
+#if defined(__linux__)
+  if (options->pages == PageMode::TRANSPARENT) {
+    madvise(base, size, MADV_HUGEPAGE);
+  }
+  if (!apply_placement(base, size, options)) {
+    fprintf(stderr, "mbind failed, placement left to first touch\n");
+  }
+#endif
+  if (options->prefault_threads) {
+    prefault_buffer((char *)base, size, options);
+  }
+
+  track_buffer(base, size, pages, true);
+  *mapped_size = size;
+  return base;
+}
+
+static void *alloc_buffer(size_t size, BufferOptions *options) {
+  void *base = map_buffer(&size, options);
+#if TRACK_ALLOCATIONS
+  // Counted against the caller's block, as a new[] in its place would be.
+  record_allocated_bytes(size);
+#endif
+  return base;
+}
+
+// Address space for output of unknown size (e.g. decompressed input), with
+// pages only backed once written. Placement and THP apply; hugetlb and
+// prefault don't, since they would commit the whole reservation.
+static void *reserve_buffer(size_t size, BufferOptions *options) {
+  TRACE_FUNC;
+
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to reserve %zu bytes\n", size);
+    exit(1);
+  }
+#if defined(__linux__)
+  if (options->pages == PageMode::TRANSPARENT) {
+    madvise(base, size, MADV_HUGEPAGE);
+  }
+  apply_placement(base, size, options);
+#endif
+
+  track_buffer(base, size, options->pages, false);
+  return base;
+}
+
+static void free_buffer(void *base) {
+  if (!base) {
+    return;
+  }
+  for (int i = 0; i < MAX_LIVE_BUFFERS; ++i) {
+    if (live_buffers[i].base == base) {
+#if TRACK_ALLOCATIONS
+      if (live_buffers[i].committed) {
+        record_freed_bytes(live_buffers[i].size);
+      }
+#endif
+      munmap(base, live_buffers[i].size);
+      live_buffers[i] = {};
+      return;
+    }
+  }
+}
+
+// The page size a buffer actually got, which for hugetlb may have fallen
+// back to 4k pages.
+static inline PageMode buffer_page_mode(void *base) {
+  for (int i = 0; i < MAX_LIVE_BUFFERS; ++i) {
+    if (live_buffers[i].base == base) {
+      return live_buffers[i].pages;
+    }
+  }
+  return PageMode::NORMAL;
+}
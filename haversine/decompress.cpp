@@ -0,0 +1,682 @@
+#include <condition_variable>
+#include <deque>
+#include <limits.h>
+#include <mutex>
+
+// Codecs are opt-in, since each needs its library on the link line: build
+// with -DHAVE_ZLIB=1 -lz, -DHAVE_ZSTD=1 -lzstd and/or -DHAVE_LZ4=1 -llz4.
+#ifndef HAVE_ZLIB
+#define HAVE_ZLIB 0
+#endif
+#ifndef HAVE_ZSTD
+#define HAVE_ZSTD 0
+#endif
+#ifndef HAVE_LZ4
+#define HAVE_LZ4 0
+#endif
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+// Decompression stage in front of the parser. It stands in for the reader
+// thread of read_pipeline.cpp: compressed bytes are pread into memory on one
+// thread, decoded into the parse buffer on another, and the decoded ranges
+// are published through the same queue, so the parser can't tell the
+// difference. Formats are picked by magic number; ones this build wasn't
+// given a codec for are reported as unsupported.
+//
+// zstd and LZ4 frames whose header records the content size and that are no
+// larger than PARALLEL_FRAME_LIMIT are decoded by a pool of workers, each
+// straight into its place in the output. Anything else (gzip, single large
+// frames, frames without a size) is decoded as a stream, a chunk at a time.
+
+#define PARALLEL_FRAME_LIMIT (32 * 1024 * 1024)
+#define FRAME_HEADER_MAX 19
+
+// Address space reserved for the decoded data, as a multiple of the
+// compressed size. Only the pages actually written get backed.
+#define DECOMPRESS_RESERVE_RATIO 64
+
+enum class Compression {
+  NONE,
+  GZIP,
+  ZSTD,
+  LZ4,
+};
+
+static const char *compression_name(Compression format) {
+  switch (format) {
+  case Compression::GZIP:
+    return "gzip";
+  case Compression::ZSTD:
+    return "zstd";
+  case Compression::LZ4:
+    return "lz4";
+  default:
+    return "none";
+  }
+}
+
+static u32 read_u32_le(const char *bytes) {
+  const unsigned char *b = (const unsigned char *)bytes;
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((u32)b[3] << 24);
+}
+
+static Compression detect_compression(int fd) {
+  unsigned char magic[4] = {};
+  if (pread(fd, magic, sizeof(magic), 0) < 4) {
+    return Compression::NONE;
+  }
+  if (magic[0] == 0x1f && magic[1] == 0x8b) {
+    return Compression::GZIP;
+  }
+  u32 word = read_u32_le((const char *)magic);
+  if (word == 0xFD2FB528) {
+    return Compression::ZSTD;
+  }
+  if (word == 0x184D2204) {
+    return Compression::LZ4;
+  }
+  return Compression::NONE;
+}
+
+static bool compression_supported(Compression format) {
+  switch (format) {
+  case Compression::GZIP:
+    return HAVE_ZLIB;
+  case Compression::ZSTD:
+    return HAVE_ZSTD;
+  case Compression::LZ4:
+    return HAVE_LZ4;
+  default:
+    return true;
+  }
+}
+
+struct FrameJob {
+  size_t in_offset;
+  size_t in_size;
+  size_t out_offset;
+  size_t out_size;
+  bool done;
+  bool failed;
+};
+
+struct DecompressStage {
+  ReadPipeline *pipeline; // output side; pipeline->buffer gets the decoded data
+  Compression format;
+  int fd;
+  size_t capacity;
+  u32 thread_count;
+
+  char *input;
+  size_t input_size;
+  std::atomic<size_t> input_available;
+  std::atomic<bool> input_done;
+  std::thread input_reader;
+  std::mutex input_lock; // only taken to wait on or signal input_ready
+  std::condition_variable input_ready;
+
+  // Frame pool, used only when thread_count > 1.
+  std::mutex lock;
+  std::condition_variable work_ready;
+  std::condition_variable work_done;
+  std::deque<FrameJob> jobs;
+  size_t next_job;
+  size_t published_jobs;
+  bool closing;
+
+  size_t output_size;
+  u32 frame_count;
+  u32 parallel_frames;
+
+  // CPU timer ticks. Decode time is summed over threads.
+  u64 read_ticks;
+  std::atomic<u64> decompress_ticks;
+};
+
+static void read_compressed_input(DecompressStage *stage) {
+  u64 start = read_cpu_timer();
+  size_t chunk_size = stage->pipeline->chunk_size;
+  size_t offset = 0;
+  while (offset < stage->input_size) {
+    size_t want = stage->input_size - offset;
+    if (want > chunk_size) {
+      want = chunk_size;
+    }
+    ssize_t got = pread(stage->fd, stage->input + offset, want, offset);
+    if (got <= 0) {
+      stage->pipeline->failed = true;
+      break;
+    }
+    offset += got;
+    stage->input_available.store(offset, std::memory_order_release);
+    // Taking the lock orders the store before a waiter's check.
+    { std::lock_guard<std::mutex> guard(stage->input_lock); }
+    stage->input_ready.notify_all();
+  }
+  stage->read_ticks = read_cpu_timer() - start;
+  stage->input_done.store(true, std::memory_order_release);
+  { std::lock_guard<std::mutex> guard(stage->input_lock); }
+  stage->input_ready.notify_all();
+}
+
+// Waits until `want` compressed bytes are in or the read is over, and
+// returns how many there are.
+static size_t wait_for_input(DecompressStage *stage, size_t want) {
+  size_t available = stage->input_available.load(std::memory_order_acquire);
+  if (available >= want) {
+    return available;
+  }
+  std::unique_lock<std::mutex> guard(stage->input_lock);
+  stage->input_ready.wait(guard, [stage, want, &available] {
+    bool done = stage->input_done.load(std::memory_order_acquire);
+    available = stage->input_available.load(std::memory_order_acquire);
+    return available >= want || done;
+  });
+  return available;
+}
+
+struct StreamDecoder {
+  Compression format;
+#if HAVE_ZLIB
+  z_stream gzip;
+#endif
+#if HAVE_ZSTD
+  ZSTD_DCtx *zstd;
+#endif
+#if HAVE_LZ4
+  LZ4F_dctx *lz4;
+#endif
+};
+
+static void init_decoder(StreamDecoder *decoder, Compression format) {
+  *decoder = {};
+  decoder->format = format;
+#if HAVE_ZLIB
+  if (format == Compression::GZIP) {
+    inflateInit2(&decoder->gzip, 15 + 32); // gzip header, max window
+  }
+#endif
+#if HAVE_ZSTD
+  if (format == Compression::ZSTD) {
+    decoder->zstd = ZSTD_createDCtx();
+  }
+#endif
+#if HAVE_LZ4
+  if (format == Compression::LZ4) {
+    LZ4F_createDecompressionContext(&decoder->lz4, LZ4F_VERSION);
+  }
+#endif
+}
+
+static void free_decoder(StreamDecoder *decoder) {
+  (void)decoder; // unused when no codec is built in
+#if HAVE_ZLIB
+  if (decoder->format == Compression::GZIP) {
+    inflateEnd(&decoder->gzip);
+  }
+#endif
+#if HAVE_ZSTD
+  ZSTD_freeDCtx(decoder->zstd);
+#endif
+#if HAVE_LZ4
+  if (decoder->lz4) {
+    LZ4F_freeDecompressionContext(decoder->lz4);
+  }
+#endif
+}
+
+enum class DecodeStep {
+  PROGRESS,
+  FRAME_END, // a frame (or gzip member) finished; the decoder is reset
+  ERROR,
+};
+
+// Decodes as much of `in` into `out` as fits. On return *in_size and
+// *out_size hold the bytes consumed and produced. Stops at the end of a
+// frame so callers can tell where frames are.
+static DecodeStep decode_step(StreamDecoder *decoder, const char *in,
+                              size_t *in_size, char *out, size_t *out_size) {
+  switch (decoder->format) {
+#if HAVE_ZLIB
+  case Compression::GZIP: {
+    z_stream *z = &decoder->gzip;
+    uInt in_limit = *in_size > UINT_MAX ? UINT_MAX : (uInt)*in_size;
+    uInt out_limit = *out_size > UINT_MAX ? UINT_MAX : (uInt)*out_size;
+    z->next_in = (Bytef *)in;
+    z->avail_in = in_limit;
+    z->next_out = (Bytef *)out;
+    z->avail_out = out_limit;
+    int result = inflate(z, Z_NO_FLUSH);
+    *in_size = in_limit - z->avail_in;
+    *out_size = out_limit - z->avail_out;
+    if (result == Z_STREAM_END) {
+      inflateReset(z); // concatenated members
+      return DecodeStep::FRAME_END;
+    }
+    return result == Z_OK || result == Z_BUF_ERROR ? DecodeStep::PROGRESS
+                                                   : DecodeStep::ERROR;
+  }
+#endif
+#if HAVE_ZSTD
+  case Compression::ZSTD: {
+    ZSTD_inBuffer input = {in, *in_size, 0};
+    ZSTD_outBuffer output = {out, *out_size, 0};
+    size_t result = ZSTD_decompressStream(decoder->zstd, &output, &input);
+    *in_size = input.pos;
+    *out_size = output.pos;
+    if (ZSTD_isError(result)) {
+      return DecodeStep::ERROR;
+    }
+    return result == 0 ? DecodeStep::FRAME_END : DecodeStep::PROGRESS;
+  }
+#endif
+#if HAVE_LZ4
+  case Compression::LZ4: {
+    size_t result =
+        LZ4F_decompress(decoder->lz4, out, out_size, in, in_size, nullptr);
+    if (LZ4F_isError(result)) {
+      return DecodeStep::ERROR;
+    }
+    return result == 0 ? DecodeStep::FRAME_END : DecodeStep::PROGRESS;
+  }
+#endif
+  default:
+    (void)in, (void)in_size, (void)out, (void)out_size;
+    return DecodeStep::ERROR;
+  }
+}
+
+static void decompress_failed(DecompressStage *stage, const char *why) {
+  if (!stage->pipeline->failed) {
+    fprintf(stderr, "Decompression failed: %s\n", why);
+  }
+  stage->pipeline->failed = true;
+}
+
+// Decodes frames as a stream from *in_pos, publishing every step. With
+// one_frame set, returns after the first frame; otherwise runs to the end of
+// the input.
+static void stream_frames(DecompressStage *stage, StreamDecoder *decoder,
+                          size_t *in_pos, bool one_frame) {
+  ReadPipeline *pipeline = stage->pipeline;
+  size_t want = *in_pos + 1;
+  bool mid_frame = false;
+
+  while (!pipeline->failed) {
+    size_t available = wait_for_input(stage, want);
+    if (available <= *in_pos) {
+      if (mid_frame || stage->input_available.load() < stage->input_size) {
+        decompress_failed(stage, "input truncated");
+      }
+      return;
+    }
+
+    size_t in_size = available - *in_pos;
+    size_t out_size = stage->capacity - stage->output_size;
+    if (out_size > pipeline->chunk_size) {
+      out_size = pipeline->chunk_size;
+    }
+    if (out_size == 0) {
+      decompress_failed(stage, "output larger than the reservation");
+      return;
+    }
+
+    u64 start = read_cpu_timer();
+    DecodeStep step =
+        decode_step(decoder, stage->input + *in_pos, &in_size,
+                    pipeline->buffer + stage->output_size, &out_size);
+    stage->decompress_ticks += read_cpu_timer() - start;
+
+    if (out_size) {
+      if (!publish_chunk(pipeline, {stage->output_size, out_size})) {
+        return; // the parser stopped early
+      }
+      stage->output_size += out_size;
+    }
+    *in_pos += in_size;
+    // Nothing moved: the decoder needs bytes that haven't arrived yet.
+    want = in_size || out_size ? *in_pos + 1 : available + 1;
+
+    if (step == DecodeStep::ERROR) {
+      decompress_failed(stage, "corrupt input");
+      return;
+    }
+    mid_frame = step != DecodeStep::FRAME_END;
+    if (step == DecodeStep::FRAME_END) {
+      stage->frame_count++;
+      if (one_frame) {
+        return;
+      }
+    }
+  }
+}
+
+#define UNKNOWN_CONTENT_SIZE (~(size_t)0)
+
+enum class FrameScan {
+  OK,
+  NEED_INPUT,
+  BAD,
+};
+
+// Content size from the frame header at `frame`, or UNKNOWN_CONTENT_SIZE.
+static FrameScan frame_content_size(Compression format, const char *frame,
+                                    size_t available, size_t *content_size) {
+  *content_size = UNKNOWN_CONTENT_SIZE;
+#if HAVE_ZSTD
+  if (format == Compression::ZSTD) {
+    unsigned long long size = ZSTD_getFrameContentSize(frame, available);
+    if (size == ZSTD_CONTENTSIZE_ERROR) {
+      return available < FRAME_HEADER_MAX ? FrameScan::NEED_INPUT
+                                          : FrameScan::BAD;
+    }
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN) {
+      *content_size = (size_t)size; // 0 for skippable frames
+    }
+    return FrameScan::OK;
+  }
+#endif
+  if (format == Compression::LZ4) {
+    if (available < 7) {
+      return FrameScan::NEED_INPUT;
+    }
+    u32 magic = read_u32_le(frame);
+    if ((magic & 0xFFFFFFF0) == 0x184D2A50) {
+      *content_size = 0; // skippable
+      return FrameScan::OK;
+    }
+    if (magic != 0x184D2204) {
+      return FrameScan::BAD;
+    }
+    unsigned char flags = frame[4];
+    if (flags & 0x08) {
+      if (available < 14) {
+        return FrameScan::NEED_INPUT;
+      }
+      *content_size = (size_t)read_u32_le(frame + 6) |
+                      (size_t)read_u32_le(frame + 10) << 32;
+    }
+    return FrameScan::OK;
+  }
+  return FrameScan::BAD;
+}
+
+// Compressed size of the frame at `frame`, walking its block headers.
+static FrameScan frame_compressed_size(Compression format, const char *frame,
+                                       size_t available, size_t *size) {
+#if HAVE_ZSTD
+  if (format == Compression::ZSTD) {
+    *size = ZSTD_findFrameCompressedSize(frame, available);
+    // Errors can't be told apart from a frame that isn't all there yet.
+    return ZSTD_isError(*size) ? FrameScan::NEED_INPUT : FrameScan::OK;
+  }
+#endif
+  if (format == Compression::LZ4) {
+    if (available < 8) {
+      return FrameScan::NEED_INPUT;
+    }
+    u32 magic = read_u32_le(frame);
+    if ((magic & 0xFFFFFFF0) == 0x184D2A50) {
+      *size = 8 + (size_t)read_u32_le(frame + 4);
+      return *size <= available ? FrameScan::OK : FrameScan::NEED_INPUT;
+    }
+
+    unsigned char flags = frame[4];
+    bool block_checksum = flags & 0x10;
+    bool content_checksum = flags & 0x04;
+    size_t pos = 4 + 2 + (flags & 0x08 ? 8 : 0) + (flags & 0x01 ? 4 : 0) + 1;
+    for (;;) {
+      if (pos + 4 > available) {
+        return FrameScan::NEED_INPUT;
+      }
+      u32 block = read_u32_le(frame + pos);
+      pos += 4;
+      if (block == 0) {
+        break; // end mark
+      }
+      pos += (block & 0x7FFFFFFF) + (block_checksum ? 4 : 0);
+    }
+    pos += content_checksum ? 4 : 0;
+    *size = pos;
+    return pos <= available ? FrameScan::OK : FrameScan::NEED_INPUT;
+  }
+  return FrameScan::BAD;
+}
+
+static bool decode_frame(StreamDecoder *decoder, const char *in, size_t in_size,
+                         char *out, size_t out_size) {
+#if HAVE_ZSTD
+  if (decoder->format == Compression::ZSTD) {
+    size_t result =
+        ZSTD_decompressDCtx(decoder->zstd, out, out_size, in, in_size);
+    return result == out_size;
+  }
+#endif
+  size_t produced = 0;
+  size_t consumed = 0;
+  for (;;) {
+    size_t in_step = in_size - consumed;
+    size_t out_step = out_size - produced;
+    DecodeStep step = decode_step(decoder, in + consumed, &in_step,
+                                  out + produced, &out_step);
+    consumed += in_step;
+    produced += out_step;
+    if (step != DecodeStep::PROGRESS) {
+      return step == DecodeStep::FRAME_END && produced == out_size;
+    }
+    if (in_step == 0 && out_step == 0) {
+      return false;
+    }
+  }
+}
+
+static void frame_worker(DecompressStage *stage) {
+  StreamDecoder decoder;
+  init_decoder(&decoder, stage->format);
+
+  std::unique_lock<std::mutex> guard(stage->lock);
+  for (;;) {
+    stage->work_ready.wait(guard, [stage] {
+      return stage->next_job < stage->jobs.size() || stage->closing;
+    });
+    if (stage->next_job == stage->jobs.size()) {
+      break;
+    }
+    FrameJob *job = &stage->jobs[stage->next_job++];
+    guard.unlock();
+
+    u64 start = read_cpu_timer();
+    bool ok = job->out_size == 0 ||
+              decode_frame(&decoder, stage->input + job->in_offset,
+                           job->in_size, stage->pipeline->buffer +
+                                             job->out_offset,
+                           job->out_size);
+    stage->decompress_ticks += read_cpu_timer() - start;
+
+    guard.lock();
+    job->failed = !ok;
+    job->done = true;
+    stage->work_done.notify_one();
+  }
+  free_decoder(&decoder);
+}
+
+// Publishes finished frames in order; with wait_all, blocks until every
+// queued frame is out.
+static void publish_frames(DecompressStage *stage, bool wait_all) {
+  std::unique_lock<std::mutex> guard(stage->lock);
+  while (stage->published_jobs < stage->jobs.size()) {
+    FrameJob *job = &stage->jobs[stage->published_jobs];
+    if (!job->done) {
+      if (!wait_all) {
+        return;
+      }
+      stage->work_done.wait(guard);
+      continue;
+    }
+    if (job->failed) {
+      decompress_failed(stage, "corrupt frame");
+      return;
+    }
+    if (job->out_size &&
+        !publish_chunk(stage->pipeline, {job->out_offset, job->out_size})) {
+      return;
+    }
+    stage->published_jobs++;
+  }
+}
+
+// Splits the input into frames as it arrives. Small frames with a known size
+// go to the workers; the rest are streamed here, after the frames before
+// them are out.
+static void dispatch_frames(DecompressStage *stage, StreamDecoder *decoder) {
+  u32 worker_count = stage->thread_count;
+  std::thread *workers = new std::thread[worker_count];
+  for (u32 i = 0; i < worker_count; ++i) {
+    workers[i] = std::thread(frame_worker, stage);
+  }
+
+  size_t in_pos = 0;
+  while (!stage->pipeline->failed && !stage->pipeline->cancelled) {
+    size_t available = wait_for_input(stage, in_pos + FRAME_HEADER_MAX);
+    if (available <= in_pos) {
+      if (available < stage->input_size) {
+        decompress_failed(stage, "input truncated");
+      }
+      break;
+    }
+
+    size_t content_size;
+    FrameScan scan = frame_content_size(stage->format, stage->input + in_pos,
+                                        available - in_pos, &content_size);
+    if (scan != FrameScan::OK) {
+      decompress_failed(stage, "bad frame header");
+      break;
+    }
+
+    if (content_size > PARALLEL_FRAME_LIMIT) {
+      publish_frames(stage, true);
+      stream_frames(stage, decoder, &in_pos, true);
+      continue;
+    }
+    if (stage->output_size + content_size > stage->capacity) {
+      decompress_failed(stage, "output larger than the reservation");
+      break;
+    }
+
+    size_t frame_size;
+    for (;;) {
+      bool done = stage->input_done.load(std::memory_order_acquire);
+      available = stage->input_available.load(std::memory_order_acquire);
+      scan = frame_compressed_size(stage->format, stage->input + in_pos,
+                                   available - in_pos, &frame_size);
+      if (scan != FrameScan::NEED_INPUT || done) {
+        break;
+      }
+      wait_for_input(stage, available + 1);
+    }
+    if (scan != FrameScan::OK) {
+      decompress_failed(stage, "corrupt or truncated frame");
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(stage->lock);
+      stage->jobs.push_back({in_pos, frame_size, stage->output_size,
+                             content_size, false, false});
+    }
+    stage->work_ready.notify_one();
+    in_pos += frame_size;
+    stage->output_size += content_size;
+    stage->frame_count++;
+    stage->parallel_frames++;
+    publish_frames(stage, false);
+  }
+
+  // Frames before a failure are still good; let the parser have them.
+  publish_frames(stage, true);
+  {
+    std::lock_guard<std::mutex> guard(stage->lock);
+    stage->closing = true;
+  }
+  stage->work_ready.notify_all();
+  for (u32 i = 0; i < worker_count; ++i) {
+    workers[i].join();
+  }
+  delete[] workers;
+}
+
+static void run_decompress_stage(DecompressStage *stage) {
+  ReadPipeline *pipeline = stage->pipeline;
+  pipeline->read_start = read_cpu_timer();
+  stage->input_reader = std::thread(read_compressed_input, stage);
+
+  StreamDecoder decoder;
+  init_decoder(&decoder, stage->format);
+  size_t in_pos = 0;
+  if (stage->thread_count > 1 && stage->format != Compression::GZIP) {
+    dispatch_frames(stage, &decoder);
+  } else {
+    stream_frames(stage, &decoder, &in_pos, false);
+  }
+  free_decoder(&decoder);
+
+  stage->input_reader.join();
+  pipeline->read_end = read_cpu_timer();
+
+  // The decoded size was only a guess until now.
+  publish_chunk(pipeline, {stage->output_size, 0});
+}
+
+// Starts decoding `fd` into `output` (capacity bytes, typically from
+// reserve_buffer) on the pipeline's reader thread. The pipeline is then
+// consumed and finished exactly like a plain read.
+static void start_decompress_stage(DecompressStage *stage,
+                                   ReadPipeline *pipeline, int fd,
+                                   Compression format, size_t input_size,
+                                   char *output, size_t capacity,
+                                   size_t chunk_size, u32 thread_count) {
+  pipeline->fd = fd;
+  pipeline->buffer = output;
+  pipeline->file_offset = 0;
+  pipeline->total_size = capacity;
+  pipeline->chunk_size = chunk_size;
+  pipeline->depth = 1;
+  pipeline->mode = ReadMode::PREAD;
+  pipeline->release_parsed = false;
+  reset_pipeline_state(pipeline);
+
+  BufferOptions input_options = {};
+  stage->pipeline = pipeline;
+  stage->format = format;
+  stage->fd = fd;
+  stage->capacity = capacity;
+  stage->thread_count = thread_count;
+  stage->input = (char *)alloc_buffer(input_size, &input_options);
+  stage->input_size = input_size;
+  stage->input_available = 0;
+  stage->input_done = false;
+  stage->next_job = stage->published_jobs = 0;
+  stage->closing = false;
+  stage->output_size = 0;
+  stage->frame_count = stage->parallel_frames = 0;
+  stage->read_ticks = 0;
+  stage->decompress_ticks = 0;
+
+  pipeline->reader = std::thread(run_decompress_stage, stage);
+}
+
+// Call after finish_read_pipeline.
+static void finish_decompress_stage(DecompressStage *stage) {
+  free_buffer(stage->input);
+  stage->input = nullptr;
+  stage->jobs.clear();
+}
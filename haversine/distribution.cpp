@@ -0,0 +1,160 @@
+#include <string.h>
+
+// Distance distribution gathered in the same pass as the mean: a fixed-bin
+// histogram over [0, half the circumference], and a quantile sketch. Both are
+// integer counts, so merging is addition: per-thread (or per-shard) copies
+// combine in any order to the same totals, and the output doesn't depend on
+// the thread count.
+//
+// The sketch is log-linear (as in HdrHistogram/DDSketch): a value's bucket
+// is its binary exponent plus the top SKETCH_MANTISSA_BITS of its mantissa,
+// taken straight from the f64 bits, so no log per pair. Each bucket spans a
+// relative width of 2^-7, and quantiles report the bucket midpoint. The rank
+// is exact, so a reported quantile is within 0.4% (relative) of the exact
+// sample at that rank for any input, with 35 * 128 buckets total.
+// Values below 2^SKETCH_MIN_EXPONENT (~1mm for distances in km, including 0)
+// share the first bucket and report 0; values from 2^SKETCH_MAX_EXPONENT up
+// share the last. The exact minimum and maximum are kept alongside, so the
+// extremes are never off by a bucket and no quantile reports a value outside
+// them. QuantileSketch is usable on its own for any positive quantity whose
+// unit puts it in that range.
+
+#define DISTANCE_BINS 32
+#define MAX_DISTANCE (3.14159265358979323846 * 6372.8)
+
+#define SKETCH_MANTISSA_BITS 7
+#define SKETCH_MIN_EXPONENT -20
+#define SKETCH_MAX_EXPONENT 15 // 2^15km > MAX_DISTANCE
+#define SKETCH_BUCKETS                                                         \
+  ((SKETCH_MAX_EXPONENT - SKETCH_MIN_EXPONENT) << SKETCH_MANTISSA_BITS)
+
+struct QuantileSketch {
+  u64 count;
+  f64 min; // valid once count > 0
+  f64 max;
+  u64 buckets[SKETCH_BUCKETS];
+};
+
+struct Distribution {
+  u64 bins[DISTANCE_BINS];
+  QuantileSketch sketch;
+};
+
+// Biased exponent and leading mantissa bits of 2^SKETCH_MIN_EXPONENT, which
+// is the first bucket.
+#define SKETCH_BASE                                                            \
+  ((u64)(1023 + SKETCH_MIN_EXPONENT) << SKETCH_MANTISSA_BITS)
+
+static inline void record_sketch(QuantileSketch *sketch, f64 value) {
+  u64 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  u64 key = bits >> (52 - SKETCH_MANTISSA_BITS);
+  u64 bucket = key > SKETCH_BASE ? key - SKETCH_BASE : 0;
+  if (bucket >= SKETCH_BUCKETS) {
+    bucket = SKETCH_BUCKETS - 1;
+  }
+  if (sketch->count == 0 || value < sketch->min) {
+    sketch->min = value;
+  }
+  if (sketch->count == 0 || value > sketch->max) {
+    sketch->max = value;
+  }
+  sketch->count += 1;
+  sketch->buckets[bucket] += 1;
+}
+
+static inline void record_distance(Distribution *distribution, f64 distance) {
+  u64 bin = (u64)(distance * (DISTANCE_BINS / MAX_DISTANCE));
+  if (bin >= DISTANCE_BINS) {
+    bin = DISTANCE_BINS - 1;
+  }
+  distribution->bins[bin] += 1;
+  record_sketch(&distribution->sketch, distance);
+}
+
+static void merge_sketch(QuantileSketch *into, QuantileSketch *from) {
+  if (from->count && (into->count == 0 || from->min < into->min)) {
+    into->min = from->min;
+  }
+  if (from->count && (into->count == 0 || from->max > into->max)) {
+    into->max = from->max;
+  }
+  into->count += from->count;
+  for (int i = 0; i < SKETCH_BUCKETS; ++i) {
+    into->buckets[i] += from->buckets[i];
+  }
+}
+
+static inline void merge_distribution(Distribution *into, Distribution *from) {
+  for (int i = 0; i < DISTANCE_BINS; ++i) {
+    into->bins[i] += from->bins[i];
+  }
+  merge_sketch(&into->sketch, &from->sketch);
+}
+
+// Midpoint of a sketch bucket; the underflow bucket reports 0.
+static f64 bucket_value(u64 bucket) {
+  if (bucket == 0) {
+    return 0.0;
+  }
+  u64 low = (bucket + SKETCH_BASE) << (52 - SKETCH_MANTISSA_BITS);
+  u64 high = (bucket + 1 + SKETCH_BASE) << (52 - SKETCH_MANTISSA_BITS);
+  f64 low_value, high_value;
+  memcpy(&low_value, &low, sizeof(low));
+  memcpy(&high_value, &high, sizeof(high));
+  return (low_value + high_value) * 0.5;
+}
+
+// The value at rank ceil(q * count), i.e. the nearest-rank quantile. The
+// first and last ranks are the exact min and max.
+static f64 sketch_quantile(QuantileSketch *sketch, f64 q) {
+  if (sketch->count == 0) {
+    return 0.0;
+  }
+  u64 rank = (u64)ceil(q * (f64)sketch->count);
+  if (rank <= 1) {
+    return sketch->min;
+  }
+  if (rank >= sketch->count) {
+    return sketch->max;
+  }
+  u64 seen = 0;
+  f64 value = bucket_value(SKETCH_BUCKETS - 1);
+  for (u64 bucket = 0; bucket < SKETCH_BUCKETS; ++bucket) {
+    seen += sketch->buckets[bucket];
+    if (seen >= rank) {
+      value = bucket_value(bucket);
+      break;
+    }
+  }
+  return value < sketch->min   ? sketch->min
+         : value > sketch->max ? sketch->max
+                               : value;
+}
+
+#define HISTOGRAM_BAR_WIDTH 40
+
+static inline void print_distribution(Distribution *distribution) {
+  QuantileSketch *sketch = &distribution->sketch;
+  printf("Distance min: %.6g p50: %.6g p95: %.6g p99: %.6g (+-0.4%%) "
+         "max: %.6g\n",
+         sketch->count ? sketch->min : 0.0, sketch_quantile(sketch, 0.50),
+         sketch_quantile(sketch, 0.95), sketch_quantile(sketch, 0.99),
+         sketch->count ? sketch->max : 0.0);
+
+  u64 largest = 1;
+  for (int i = 0; i < DISTANCE_BINS; ++i) {
+    if (distribution->bins[i] > largest) {
+      largest = distribution->bins[i];
+    }
+  }
+  f64 width = MAX_DISTANCE / DISTANCE_BINS;
+  for (int i = 0; i < DISTANCE_BINS; ++i) {
+    u64 count = distribution->bins[i];
+    int bar = (int)(count * HISTOGRAM_BAR_WIDTH / largest);
+    printf("%7.0f-%-7.0f %10llu %5.1f%% %.*s\n", i * width, (i + 1) * width,
+           (unsigned long long)count,
+           sketch->count ? 100.0 * count / sketch->count : 0.0, bar,
+           "########################################");
+  }
+}
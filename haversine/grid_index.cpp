@@ -0,0 +1,176 @@
+// Uniform lat/lon grid over pair start points, for mean distance over pairs
+// inside a bounding box. Pairs are counting-sorted by start cell and stored
+// column-wise, and every cell keeps its distance sum, so a box query adds
+// whole cells that lie inside the box and only scans the cells on its edge.
+
+struct GridIndex {
+  u32 columns;
+  u32 rows;
+  f64 cell_width;
+  f64 cell_height;
+
+  u32 *cell_offsets; // pairs of cell c are [cell_offsets[c], cell_offsets[c + 1])
+  f64 *cell_sums;
+
+  // Pair data in cell order.
+  f64 *x0;
+  f64 *y0;
+  f64 *x1;
+  f64 *y1;
+  f64 *distances;
+};
+
+// min_x > max_x is a box across the antimeridian: [min_x, 180] plus
+// [-180, max_x].
+struct BoundingBox {
+  f64 min_x;
+  f64 min_y;
+  f64 max_x;
+  f64 max_y;
+};
+
+struct BoxResult {
+  u64 count;
+  f64 sum;
+  u64 cells_summed;
+  u64 cells_scanned;
+};
+
+static u32 grid_column(GridIndex *grid, f64 x) {
+  f64 column = (x + 180.0) / grid->cell_width;
+  return column <= 0 ? 0
+         : column >= grid->columns ? grid->columns - 1
+                                   : (u32)column;
+}
+
+static u32 grid_row(GridIndex *grid, f64 y) {
+  f64 row = (y + 90.0) / grid->cell_height;
+  return row <= 0 ? 0 : row >= grid->rows ? grid->rows - 1 : (u32)row;
+}
+
+static GridIndex build_grid_index(Output *output, u32 columns, u32 rows) {
+  TRACE_FUNC;
+
+  GridIndex grid = {};
+  grid.columns = columns;
+  grid.rows = rows;
+  grid.cell_width = 360.0 / columns;
+  grid.cell_height = 180.0 / rows;
+
+  u32 cell_count = columns * rows;
+  size_t count = output->num_pairs;
+  grid.cell_offsets = new u32[cell_count + 1]();
+  grid.cell_sums = new f64[cell_count]();
+  grid.x0 = new f64[count];
+  grid.y0 = new f64[count];
+  grid.x1 = new f64[count];
+  grid.y1 = new f64[count];
+  grid.distances = new f64[count];
+
+  u32 *pair_cells = new u32[count];
+  for (size_t i = 0; i < count; ++i) {
+    u32 cell = grid_row(&grid, output->pairs[i][1]) * columns +
+               grid_column(&grid, output->pairs[i][0]);
+    pair_cells[i] = cell;
+    grid.cell_offsets[cell + 1]++;
+  }
+  for (u32 cell = 0; cell < cell_count; ++cell) {
+    grid.cell_offsets[cell + 1] += grid.cell_offsets[cell];
+  }
+
+  u32 *cursor = new u32[cell_count];
+  memcpy(cursor, grid.cell_offsets, cell_count * sizeof(u32));
+  for (size_t i = 0; i < count; ++i) {
+    u32 cell = pair_cells[i];
+    u32 slot = cursor[cell]++;
+    f64 *pair = output->pairs[i];
+    f64 distance = ReferenceHaversine(pair[0], pair[1], pair[2], pair[3], 6372.8);
+
+    grid.x0[slot] = pair[0];
+    grid.y0[slot] = pair[1];
+    grid.x1[slot] = pair[2];
+    grid.y1[slot] = pair[3];
+    grid.distances[slot] = distance;
+    grid.cell_sums[cell] += distance;
+  }
+
+  delete[] cursor;
+  delete[] pair_cells;
+  return grid;
+}
+
+static bool in_x_range(BoundingBox *box, f64 min_x, f64 max_x) {
+  return box->min_x <= box->max_x
+             ? min_x >= box->min_x && max_x <= box->max_x
+             : min_x >= box->min_x || max_x <= box->max_x;
+}
+
+static bool in_box(BoundingBox *box, f64 x, f64 y) {
+  return in_x_range(box, x, x) && y >= box->min_y && y <= box->max_y;
+}
+
+// Pairs whose start point (and with both_endpoints, also end point) lies in
+// the box. Cell sums can only stand in for start-point matches, so
+// both_endpoints scans every cell the box touches. A box across the
+// antimeridian walks its columns from min_x eastwards, wrapping at 180.
+static BoxResult query_grid_box(GridIndex *grid, BoundingBox *box,
+                                bool both_endpoints) {
+  TRACE_FUNC;
+
+  BoxResult result = {};
+  u32 first_column = grid_column(grid, box->min_x);
+  u32 last_column = grid_column(grid, box->max_x);
+  u32 first_row = grid_row(grid, box->min_y);
+  u32 last_row = grid_row(grid, box->max_y);
+  u32 column_count = last_column - first_column + 1;
+  if (box->min_x > box->max_x && first_column > last_column) {
+    column_count = grid->columns - first_column + last_column + 1;
+  } else if (box->min_x > box->max_x) {
+    // Both edges in one column: the box wraps around to cover every column.
+    first_column = 0;
+    column_count = grid->columns;
+  }
+
+  for (u32 row = first_row; row <= last_row; ++row) {
+    f64 cell_min_y = row * grid->cell_height - 90.0;
+    f64 cell_max_y = cell_min_y + grid->cell_height;
+
+    for (u32 step = 0; step < column_count; ++step) {
+      u32 column = (first_column + step) % grid->columns;
+      f64 cell_min_x = column * grid->cell_width - 180.0;
+      f64 cell_max_x = cell_min_x + grid->cell_width;
+      u32 cell = row * grid->columns + column;
+      u32 begin = grid->cell_offsets[cell];
+      u32 end = grid->cell_offsets[cell + 1];
+
+      bool covered = in_x_range(box, cell_min_x, cell_max_x) &&
+                     cell_min_y >= box->min_y && cell_max_y <= box->max_y;
+      if (covered && !both_endpoints) {
+        result.sum += grid->cell_sums[cell];
+        result.count += end - begin;
+        result.cells_summed++;
+        continue;
+      }
+
+      result.cells_scanned++;
+      for (u32 i = begin; i < end; ++i) {
+        bool match = in_box(box, grid->x0[i], grid->y0[i]) &&
+                     (!both_endpoints || in_box(box, grid->x1[i], grid->y1[i]));
+        result.sum += match ? grid->distances[i] : 0.0;
+        result.count += match;
+      }
+    }
+  }
+
+  return result;
+}
+
+static void free_grid_index(GridIndex *grid) {
+  delete[] grid->cell_offsets;
+  delete[] grid->cell_sums;
+  delete[] grid->x0;
+  delete[] grid->y0;
+  delete[] grid->x1;
+  delete[] grid->y1;
+  delete[] grid->distances;
+}
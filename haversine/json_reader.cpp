@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+
+// On-demand JSON reader: a cursor over a buffer that the caller steers
+// through objects and arrays, reading the values it wants and skipping the
+// rest. Nothing is allocated or copied; strings come back as views into the
+// buffer with escapes left as they are.
+//
+//   json_enter_object(&reader);
+//   JsonString key;
+//   while (json_next_field(&reader, &key)) {
+//     if (json_key_is(key, "pairs")) ... else json_skip_value(&reader);
+//   }
+//
+// The buffer may still be filling (see read_pipeline.cpp). Bytes below
+// `limit` are readable; when the cursor reaches it the reader asks `refill`
+// for more. Refill limits always end just past a ',' or '}', so a number
+// that starts below the limit also ends below it; strings, literals and
+// whitespace check for the limit byte by byte.
+//
+// The buffer must be followed by at least one byte that can't continue a
+// number (the parse buffers are zero padded).
+
+enum class JsonType {
+  NONE, // end of input or not a value
+  OBJECT,
+  ARRAY,
+  STRING,
+  NUMBER,
+  LITERAL, // true, false or null
+};
+
+struct JsonString {
+  const char *data;
+  size_t length;
+};
+
+struct JsonReader {
+  const char *data;
+  size_t pos;
+  size_t limit;
+
+  // Returns the new limit given the current position, or a limit <= pos at
+  // the end of input. Null when the whole buffer is already there.
+  size_t (*refill)(void *context, size_t pos);
+  void *context;
+
+  bool failed; // malformed or truncated input
+};
+
+static bool json_refill(JsonReader *r) {
+  if (r->refill) {
+    r->limit = r->refill(r->context, r->pos);
+  }
+  return r->pos < r->limit;
+}
+
+static inline bool json_has_byte(JsonReader *r) {
+  return r->pos < r->limit || json_refill(r);
+}
+
+static inline bool json_skip_space(JsonReader *r) {
+  while (json_has_byte(r)) {
+    char c = r->data[r->pos];
+    if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+      return true;
+    }
+    r->pos++;
+  }
+  return false;
+}
+
+static JsonType json_peek(JsonReader *r) {
+  if (!json_skip_space(r)) {
+    return JsonType::NONE;
+  }
+  switch (r->data[r->pos]) {
+  case '{':
+    return JsonType::OBJECT;
+  case '[':
+    return JsonType::ARRAY;
+  case '"':
+    return JsonType::STRING;
+  case 't':
+  case 'f':
+  case 'n':
+    return JsonType::LITERAL;
+  case '-':
+  case '0':
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+  case '8':
+  case '9':
+    return JsonType::NUMBER;
+  default:
+    return JsonType::NONE;
+  }
+}
+
+static inline bool json_key_is(JsonString key, const char *name) {
+  return strncmp(key.data, name, key.length) == 0 && name[key.length] == '\0';
+}
+
+// Expects the cursor on the opening quote; leaves it past the closing one.
+static JsonString json_read_string(JsonReader *r) {
+  size_t start = ++r->pos;
+  while (json_has_byte(r)) {
+    char c = r->data[r->pos];
+    if (c == '"') {
+      JsonString string = {r->data + start, r->pos - start};
+      r->pos++;
+      return string;
+    }
+    r->pos += c == '\\' ? 2 : 1;
+  }
+  r->failed = true;
+  return {r->data + start, r->pos - start};
+}
+
+static inline bool json_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// JSON's number grammar, which is stricter than strtod's: no hex, inf, nan,
+// leading '+' or '.', or leading zeros. Returns the end, or null.
+static const char *json_number_end(const char *c) {
+  c += *c == '-';
+  if (*c == '0') {
+    c++;
+  } else if (json_is_digit(*c)) {
+    while (json_is_digit(*c)) {
+      c++;
+    }
+  } else {
+    return nullptr;
+  }
+  if (*c == '.') {
+    if (!json_is_digit(*++c)) {
+      return nullptr;
+    }
+    while (json_is_digit(*c)) {
+      c++;
+    }
+  }
+  if (*c == 'e' || *c == 'E') {
+    c++;
+    c += *c == '+' || *c == '-';
+    if (!json_is_digit(*c)) {
+      return nullptr;
+    }
+    while (json_is_digit(*c)) {
+      c++;
+    }
+  }
+  return c;
+}
+
+static f64 json_read_number(JsonReader *r) {
+  const char *start = r->data + r->pos;
+  const char *valid_end = json_number_end(start);
+  char *end;
+  f64 value = valid_end ? strtod(start, &end) : 0.0;
+  if (!valid_end || end != valid_end) {
+    r->failed = true;
+    return 0.0;
+  }
+  r->pos += end - start;
+  return value;
+}
+
+// Expects the cursor on the first letter of true, false or null.
+static void json_skip_literal(JsonReader *r) {
+  char first = r->data[r->pos];
+  const char *word = first == 't' ? "true" : first == 'f' ? "false" : "null";
+  for (const char *c = word; *c; ++c) {
+    if (!json_has_byte(r) || r->data[r->pos] != *c) {
+      r->failed = true;
+      return;
+    }
+    r->pos++;
+  }
+}
+
+static void json_skip_value(JsonReader *r) {
+  switch (json_peek(r)) {
+  case JsonType::STRING:
+    json_read_string(r);
+    return;
+  case JsonType::NUMBER:
+    json_read_number(r);
+    return;
+  case JsonType::LITERAL:
+    json_skip_literal(r);
+    return;
+  case JsonType::OBJECT:
+  case JsonType::ARRAY: {
+    u32 depth = 0;
+    do {
+      if (!json_has_byte(r)) {
+        r->failed = true;
+        return;
+      }
+      char c = r->data[r->pos];
+      if (c == '"') {
+        json_read_string(r);
+        continue;
+      }
+      depth += c == '{' || c == '[';
+      depth -= c == '}' || c == ']';
+      r->pos++;
+    } while (depth);
+    return;
+  }
+  default:
+    r->failed = true;
+    return;
+  }
+}
+
+static bool json_enter(JsonReader *r, JsonType type) {
+  if (json_peek(r) != type) {
+    r->failed = true;
+    return false;
+  }
+  r->pos++;
+  return true;
+}
+
+static bool json_enter_object(JsonReader *r) {
+  return json_enter(r, JsonType::OBJECT);
+}
+
+static bool json_enter_array(JsonReader *r) {
+  return json_enter(r, JsonType::ARRAY);
+}
+
+// Steps to the next entry of the current object or array. Returns false,
+// past the closing bracket, once there are no more. A ',' before the first
+// entry is tolerated, which is what lets parsing resume mid-array.
+static inline bool json_next_entry(JsonReader *r, char close) {
+  if (!json_skip_space(r)) {
+    r->failed = true;
+    return false;
+  }
+  if (r->data[r->pos] == ',') {
+    r->pos++;
+    if (!json_skip_space(r)) {
+      r->failed = true;
+      return false;
+    }
+  }
+  if (r->data[r->pos] == close) {
+    r->pos++;
+    return false;
+  }
+  return true;
+}
+
+// Reads the next key and leaves the cursor on its value.
+static bool json_next_field(JsonReader *r, JsonString *key) {
+  if (!json_next_entry(r, '}')) {
+    return false;
+  }
+  if (r->data[r->pos] != '"') {
+    r->failed = true;
+    return false;
+  }
+  *key = json_read_string(r);
+  if (!json_skip_space(r) || r->data[r->pos] != ':') {
+    r->failed = true;
+    return false;
+  }
+  r->pos++;
+  return true;
+}
+
+// Leaves the cursor on the next element.
+static bool json_next_element(JsonReader *r) {
+  return json_next_entry(r, ']');
+}
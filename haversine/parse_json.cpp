@@ -7,174 +7,211 @@
 typedef double f64;
 #include "../computer_enhance/perfaware/part2/listing_0065_haversine_formula.cpp"
 #include "../timing/time.cc"
+#include "../timing/results.cc"
+#include "parse_pairs.cpp"
+#include "grid_index.cpp"
+#include "checkpoint.cpp"
+#include "precision.cpp"
+#include "distribution.cpp"
+#include "reduction.cpp"
 
 using namespace std;
 
-typedef struct Output {
-  size_t num_pairs;
-  long total_size;
-  double (*pairs)[4];
-} Output;
-
-Output parse(ifstream &json_file) {
+#define MAX_BOXES 16
 
+f64 compute_average(Output *output, u32 thread_count,
+                    Distribution *distribution) {
   TRACE_FUNC;
 
-  string total_lines = "";
-  string line;
+  return parallel_average(output, thread_count, distribution);
+}
 
-  json_file.seekg(0, json_file.end);
-  long total_size = json_file.tellg();
-  json_file.seekg(0, json_file.beg);
+f64 compute_weighted_average(Output *output) {
+  TRACE_FUNC;
 
-  char *buffer = new char[total_size];
+  f64 weighted_sum = 0.0;
+  f64 total_weight = 0.0;
 
-  {
-    TRACE_BANDWIDTH("read file", total_size);
-    json_file.read(buffer, total_size);
+  for (size_t i = 0; i < output->num_pairs; ++i) {
+    f64 weight = output->weights[i];
+    weighted_sum +=
+        weight * ReferenceHaversine(output->pairs[i][0], output->pairs[i][1],
+                                    output->pairs[i][2], output->pairs[i][3],
+                                    6372.8);
+    total_weight += weight;
   }
-  json_file.close();
-
-  size_t i = 0;
-  int depth = 0;
 
-  char current_key[1024];
-  int key_len = -1;
-  current_key[0] = '\0';
-
-  bool in_pairs = false;
-  bool done = false;
+  return total_weight != 0.0 ? weighted_sum / total_weight : 0.0;
+}
 
-  double (*input_pairs)[4] = new double[total_size / 4][4];
-  size_t pair_length = 0;
-  while (i < total_size) {
-    TRACE_BLOCK("parse_while");
-    if (done)
-      break;
-    switch (buffer[i]) {
+int main(int argc, char **argv) {
+  begin_profile();
 
-    case '[': {
-      if (strcmp(current_key, "pairs") == 0) {
-        in_pairs = true;
+  ReadOptions options = {HAVE_IO_URING ? ReadMode::URING : ReadMode::PREAD,
+                         1024 * 1024, 4, 0, {}, 0};
+  const char *fileName = nullptr;
+  u32 grid_columns = 360;
+  u32 grid_rows = 180;
+  BoundingBox boxes[MAX_BOXES];
+  int box_count = 0;
+  bool both_endpoints = false;
+  bool incremental = false;
+  const char *results_path = nullptr;
+  Precision precision = Precision::F64;
+  bool precision_report = false;
+  bool distribution_report = false;
+  bool prefault = false;
+  bool bad_args = false;
+  u32 thread_count = std::thread::hardware_concurrency();
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-read") == 0 && i + 1 < argc) {
+      const char *mode = argv[++i];
+      options.mode = strcmp(mode, "sync") == 0    ? ReadMode::SYNC
+                     : strcmp(mode, "pread") == 0 ? ReadMode::PREAD
+                                                  : ReadMode::URING;
+    } else if (strcmp(argv[i], "-chunk") == 0 && i + 1 < argc) {
+      options.chunk_size = (size_t)atol(argv[++i]) * 1024;
+    } else if (strcmp(argv[i], "-depth") == 0 && i + 1 < argc) {
+      options.depth = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-grid") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%ux%u", &grid_columns, &grid_rows) != 2) {
+        bad_args = true;
       }
-      break;
-    }
-    case ']': // currently once we exit the array, all the information has been
-              // gathered.
-    {
-      done = true;
-      break;
-    }
-    case '{': {
-      if (in_pairs) {
-        pair_length += 1;
+    } else if (strcmp(argv[i], "-box") == 0 && i + 1 < argc) {
+      if (box_count == MAX_BOXES) {
+        fprintf(stderr, "At most %d -box queries\n", MAX_BOXES);
+        return 1;
       }
-
-      break;
-    }
-    case '"': // resolve key
-    {
-      TRACE_BLOCK("key resolve");
-      int kstart = i + 1;
-      i += 1;
-      while (buffer[i] != '"') {
-        i += 1;
+      // min_x > max_x is a box across the antimeridian.
+      BoundingBox *box = &boxes[box_count++];
+      if (sscanf(argv[++i], "%lf,%lf,%lf,%lf", &box->min_x, &box->min_y,
+                 &box->max_x, &box->max_y) != 4 ||
+          box->min_y > box->max_y) {
+        bad_args = true;
       }
-      memcpy(current_key, buffer + kstart, i - kstart);
-      key_len = i - kstart;
-      current_key[key_len] = '\0';
-
-      i += 1; // skip :
-
-      break;
-    }
-
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-    case '-': {
-      TRACE_BLOCK("number");
-      int nstart = i;
-      while ((buffer[i] - '0' >= 0 && buffer[i] - '0' <= 9) ||
-             buffer[i] == '.' || buffer[i] == '-') {
-        i += 1;
+    } else if (strcmp(argv[i], "-both") == 0) {
+      both_endpoints = true;
+    } else if (strcmp(argv[i], "-incremental") == 0) {
+      incremental = true;
+    } else if (strcmp(argv[i], "-precision") == 0 && i + 1 < argc) {
+      if (!parse_precision(argv[++i], &precision)) {
+        bad_args = true;
       }
-
-      char saved = buffer[i];
-      buffer[i] = '\0';
-      double num = atof(buffer + nstart);
-      buffer[i] = saved;
-
-      if (strcmp(current_key, "x0") == 0) {
-        input_pairs[pair_length - 1][0] = num;
-      } else if (strcmp(current_key, "y0") == 0) {
-        input_pairs[pair_length - 1][1] = num;
-      } else if (strcmp(current_key, "x1") == 0) {
-        input_pairs[pair_length - 1][2] = num;
-      } else if (strcmp(current_key, "y1") == 0) {
-        input_pairs[pair_length - 1][3] = num;
+    } else if (strcmp(argv[i], "-precision-report") == 0) {
+      precision_report = true;
+    } else if (strcmp(argv[i], "-distribution") == 0) {
+      distribution_report = true;
+    } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+      thread_count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-numa") == 0 && i + 1 < argc) {
+      if (!parse_placement(argv[++i], &options.buffers)) {
+        bad_args = true;
       }
-      break;
-    }
-    case ' ':
-    case '\n':
-    case '\r':
-    case '}':
-    case ':':
-    default: {
-      break;
-    }
+    } else if (strcmp(argv[i], "-pages") == 0 && i + 1 < argc) {
+      if (!parse_page_mode(argv[++i], &options.buffers)) {
+        bad_args = true;
+      }
+    } else if (strcmp(argv[i], "-prefault") == 0) {
+      // The count is optional and defaults to -threads.
+      prefault = true;
+      if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+        options.buffers.prefault_threads = atoi(argv[++i]);
+      }
+    } else if (strcmp(argv[i], "-decompress-threads") == 0 && i + 1 < argc) {
+      options.decompress_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-results") == 0 && i + 1 < argc) {
+      results_path = argv[++i];
+    } else {
+      fileName = argv[i];
     }
-    i += 1;
   }
 
-  delete[] buffer;
-
-  return {pair_length, total_size, input_pairs};
-}
-
-f64 compute_average(Output *output) {
-  TRACE_FUNC;
-
-  double average_haversine = 0.0;
-  size_t current_added = 0;
-
-  for (int i = 0; i < output->num_pairs; ++i) {
-    TRACE_BLOCK("loop");
-    double result =
-        ReferenceHaversine(output->pairs[i][0], output->pairs[i][1],
-                           output->pairs[i][2], output->pairs[i][3], 6372.8);
+  if (bad_args || !fileName || options.chunk_size == 0 || options.depth == 0 ||
+      thread_count == 0 || grid_columns == 0 || grid_rows == 0) {
+    fprintf(stderr,
+            "Usage: %s [-read sync|pread|uring] [-chunk kb] [-depth n] "
+            "[-grid COLSxROWS] [-box minx,miny,maxx,maxy]... [-both] "
+            "[-incremental] [-precision f64|mixed|f32|table] "
+            "[-precision-report] [-distribution] [-threads n] "
+            "[-numa first-touch|interleave|NODE] [-pages 4k|thp|hugetlb] "
+            "[-prefault [threads]] [-decompress-threads n] "
+            "[-results file.jsonl|file.csv] "
+            "[filename|-]\n",
+            argv[0]);
+    return 1;
+  }
 
-    current_added++;
-    double delta = result - average_haversine;
-    average_haversine += delta / current_added;
+  // Pre-fault in the stripes the reduction workers will read. Placement only
+  // matches theirs when there is one prefault thread per worker.
+  options.buffers.prefault_stripe = REDUCE_BLOCK * sizeof(f64[4]);
+  if (prefault && options.buffers.prefault_threads == 0) {
+    options.buffers.prefault_threads = thread_count;
+  } else if (prefault && options.buffers.prefault_threads != thread_count) {
+    printf("-prefault %u with -threads %u: first-touch stripes won't match "
+           "the reduction workers\n",
+           options.buffers.prefault_threads, thread_count);
   }
 
-  return average_haversine;
-}
+  if (incremental) {
+    // Resume offsets are file offsets, so only plain files can resume.
+    int fd = strcmp(fileName, "-") == 0 ? -1 : open(fileName, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+        detect_compression(fd) != Compression::NONE) {
+      printf("Only uncompressed files can be resumed, ignoring "
+             "-incremental\n");
+      incremental = false;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
 
-int main(int argc, char **argv) {
-  begin_profile();
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s [filename]\n", argv[0]);
-    return 1;
+  Checkpoint checkpoint = {};
+  if (incremental && load_checkpoint(fileName, &checkpoint)) {
+    options.resume_offset = checkpoint.resume_offset;
+    printf("Resuming at byte %llu after %llu checkpointed pairs\n",
+           (unsigned long long)checkpoint.resume_offset,
+           (unsigned long long)checkpoint.pair_count);
+  } else if (incremental) {
+    printf("No valid checkpoint, parsing from the start\n");
   }
 
-  const char *fileName = argv[1];
-  ifstream file(fileName);
-  Output output = parse(file);
+  Output output = parse(fileName, &options);
 
   printf("Input Size: %ld\n", output.total_size);
   printf("Pair count: %lu\n", output.num_pairs);
 
-  f64 average_haversine = compute_average(&output);
+  init_trig_table();
+  f64 average_haversine;
+  Distribution *distribution =
+      distribution_report ? new Distribution() : nullptr;
+  if (precision == Precision::F64) {
+    average_haversine = compute_average(&output, thread_count, distribution);
+  } else {
+    f32 *narrow = narrow_pairs(&output);
+    average_haversine = average_for_precision(&output, narrow, precision);
+    delete[] narrow;
+  }
+
+  if (incremental) {
+    average_haversine =
+        merge_means(checkpoint.mean, checkpoint.pair_count, average_haversine,
+                    output.num_pairs);
+    checkpoint.pair_count += output.num_pairs;
+    checkpoint.mean = average_haversine;
+    checkpoint.resume_offset = output.last_pair_end;
+    if (output.incomplete) {
+      printf("Input stopped early, checkpoint not updated\n");
+    } else {
+      save_checkpoint(fileName, &checkpoint);
+    }
+    printf("Total pair count: %llu\n",
+           (unsigned long long)checkpoint.pair_count);
+  }
 
   // u64 total_elapsed = t2 - t0;
   // u64 parse_time = t1 - t0;
@@ -188,6 +225,59 @@ int main(int argc, char **argv) {
   //        (f64)(t2 - t1) / (f64)total_elapsed);
   //
   printf("Haversine Sum: %.17g\n", average_haversine);
-  delete output.pairs;
+  if (output.weights) {
+    printf("Weighted Haversine Average: %.17g\n",
+           compute_weighted_average(&output));
+  }
+  if (output.ids) {
+    printf("Pair ids: present\n");
+  }
+
+  if (distribution && precision != Precision::F64) {
+    printf("-distribution is only gathered with -precision f64\n");
+  } else if (distribution) {
+    if (incremental) {
+      printf("Distribution of the %lu pairs parsed in this run:\n",
+             output.num_pairs);
+    }
+    print_distribution(distribution);
+  }
+  delete distribution;
+
+  if (precision_report) {
+    print_precision_report(&output);
+  }
+
+  if (box_count) {
+    GridIndex grid = build_grid_index(&output, grid_columns, grid_rows);
+    for (int i = 0; i < box_count; ++i) {
+      BoundingBox *box = &boxes[i];
+      u64 t0 = read_cpu_timer();
+      BoxResult result = query_grid_box(&grid, box, both_endpoints);
+      u64 t1 = read_cpu_timer();
+
+      printf("Box [%g,%g]-[%g,%g]: %llu pairs, mean %.17g (%llu cells summed, "
+             "%llu scanned, %.1fus)\n",
+             box->min_x, box->min_y, box->max_x, box->max_y,
+             (unsigned long long)result.count,
+             result.count ? result.sum / result.count : 0.0,
+             (unsigned long long)result.cells_summed,
+             (unsigned long long)result.cells_scanned,
+             (f64)(t1 - t0) * 1e6 / (f64)get_cpu_timer_frequency());
+    }
+    free_grid_index(&grid);
+  }
+
+  free_buffer(output.pairs);
+  free_buffer(output.weights);
+  free_buffer(output.ids);
   end_profile();
+
+  if (results_path) {
+    ResultSink sink;
+    if (open_results(&sink, results_path, "parse_json")) {
+      write_profile_results(&sink);
+      close_results(&sink);
+    }
+  }
 }
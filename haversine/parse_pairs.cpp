@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_alloc.cpp"
+#include "read_pipeline.cpp"
+#include "decompress.cpp"
+#include "json_reader.cpp"
+
+// Parser for { "pairs": [ {x0,y0,x1,y1,...}, ... ] } files, shared by the
+// haversine tools. Expects f64, ReferenceHaversine and the profiler from the
+// including file. Built on the on-demand reader, so other top-level fields,
+// extra keys in a pair and nested values are skipped rather than misread.
+
+typedef struct Output {
+  size_t num_pairs;
+  long total_size;
+  double (*pairs)[4];
+
+  // Optional per-pair columns, null unless the input has the field.
+  f64 *weights;
+  f64 *ids;
+
+  // File offset just past the last pair object, where an appended tail
+  // would resume.
+  long last_pair_end;
+
+  // Parsing stopped early, on malformed or truncated input or a failed read.
+  bool incomplete;
+} Output;
+
+// Keys are resolved straight from the input bytes to a small ID with a
+// perfect hash over the schema's key names, so the hot path never copies or
+// strcmp's a key.
+enum KeyId : uint8_t {
+  KEY_UNKNOWN,
+  KEY_PAIRS,
+  KEY_X0,
+  KEY_Y0,
+  KEY_X1,
+  KEY_Y1,
+  KEY_WEIGHT,
+  KEY_ID,
+  KEY_COUNT,
+};
+
+struct KeyEntry {
+  uint64_t word;
+  KeyId id;
+};
+
+static constexpr const char *KEY_NAMES[KEY_COUNT] = {
+    "", "pairs", "x0", "y0", "x1", "y1", "weight", "id"};
+
+#define KEY_HASH_BITS 4
+#define KEY_HASH_MULTIPLIER 0x2127599bf4325c37ull
+
+// Keys of up to 8 bytes packed little-endian, as loaded from the buffer.
+static constexpr uint64_t key_word(const char *key) {
+  uint64_t word = 0;
+  for (int i = 0; i < 8 && key[i]; ++i) {
+    word |= (uint64_t)(uint8_t)key[i] << (8 * i);
+  }
+  return word;
+}
+
+static constexpr uint32_t key_hash(uint64_t word) {
+  return (uint32_t)((word * KEY_HASH_MULTIPLIER) >> (64 - KEY_HASH_BITS));
+}
+
+struct KeyTable {
+  KeyEntry entries[1 << KEY_HASH_BITS];
+};
+
+static constexpr KeyTable build_key_table() {
+  KeyTable table = {};
+  for (int id = 1; id < KEY_COUNT; ++id) {
+    uint64_t word = key_word(KEY_NAMES[id]);
+    table.entries[key_hash(word)] = {word, (KeyId)id};
+  }
+  return table;
+}
+
+static constexpr bool key_table_is_perfect() {
+  KeyTable table = build_key_table();
+  for (int id = 1; id < KEY_COUNT; ++id) {
+    if (table.entries[key_hash(key_word(KEY_NAMES[id]))].id != id) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(key_table_is_perfect(),
+              "key hash collides, pick another KEY_HASH_MULTIPLIER");
+
+static constexpr KeyTable KEY_TABLE = build_key_table();
+
+// The buffer is padded so an 8-byte load at any key start stays in bounds.
+#define KEY_LOAD_PADDING 8
+
+inline KeyId resolve_key(const char *key, size_t len) {
+  if (len == 0 || len > 8) {
+    return KEY_UNKNOWN;
+  }
+
+  uint64_t word;
+  memcpy(&word, key, sizeof(word));
+  if (len < 8) {
+    word &= (1ull << (8 * len)) - 1;
+  }
+
+  const KeyEntry &entry = KEY_TABLE.entries[key_hash(word)];
+  return entry.word == word ? entry.id : KEY_UNKNOWN;
+}
+
+// Where numbers for a key go: row r of the column lives at base + r * stride.
+struct KeyColumn {
+  f64 *base;
+  size_t stride;
+};
+
+// Address space for input of unknown size read from a pipe. Parsed pages are
+// released as the parser goes, so only the read-ahead is resident.
+#define STREAM_RESERVE ((size_t)64 << 30)
+
+// Pair capacity that stream and compressed input start from. With no file
+// size to go by, their columns double whenever they fill up.
+#define INITIAL_PAIR_CAPACITY ((size_t)64 * 1024)
+
+struct ReadOptions {
+  ReadMode mode;
+  size_t chunk_size;
+  u32 depth;
+
+  // When non-zero, parsing starts at this file offset inside the pairs array
+  // (just after a previously parsed pair) instead of at the top of the file.
+  long resume_offset;
+
+  // Placement and page size of the file buffer and the pair array.
+  BufferOptions buffers;
+
+  // Frame decoders for compressed input; 0 means one per hardware thread.
+  u32 decompress_threads;
+};
+
+// Destination of the parsed pairs. Optional columns are reserved the first
+// time the input uses them, so an oversized capacity only costs address space.
+struct PairColumns {
+  double (*pairs)[4];
+  f64 *weights;
+  f64 *ids;
+  size_t count;
+  size_t capacity;
+  KeyColumn columns[KEY_COUNT];
+  size_t last_pair_end; // buffer offset just past the last pair object
+  BufferOptions *buffers;
+};
+
+static void point_key_columns(PairColumns *out) {
+  out->columns[KEY_X0] = {&out->pairs[0][0], 4};
+  out->columns[KEY_Y0] = {&out->pairs[0][1], 4};
+  out->columns[KEY_X1] = {&out->pairs[0][2], 4};
+  out->columns[KEY_Y1] = {&out->pairs[0][3], 4};
+  out->columns[KEY_WEIGHT] = {out->weights, 1};
+  out->columns[KEY_ID] = {out->ids, 1};
+}
+
+static f64 *grow_column(f64 *column, size_t count, size_t capacity,
+                        BufferOptions *buffers) {
+  if (!column) {
+    return nullptr;
+  }
+  f64 *grown = (f64 *)reserve_buffer(capacity * sizeof(f64), buffers);
+  memcpy(grown, column, count * sizeof(f64));
+  free_buffer(column);
+  return grown;
+}
+
+// Doubles the capacity of every column, moving the rows read so far.
+static void grow_pair_columns(PairColumns *out) {
+  TRACE_FUNC;
+
+  size_t capacity =
+      out->capacity ? out->capacity * 2 : INITIAL_PAIR_CAPACITY;
+  double (*pairs)[4] =
+      (double (*)[4])alloc_buffer(capacity * sizeof(*pairs), out->buffers);
+  memcpy(pairs, out->pairs, out->count * sizeof(*pairs));
+  free_buffer(out->pairs);
+  out->pairs = pairs;
+  out->weights = grow_column(out->weights, out->count, capacity, out->buffers);
+  out->ids = grow_column(out->ids, out->count, capacity, out->buffers);
+  out->capacity = capacity;
+  point_key_columns(out);
+}
+
+static size_t refill_from_pipeline(void *context, size_t pos) {
+  TRACE_BLOCK("read wait");
+  return wait_for_parse_limit((ReadPipeline *)context, pos);
+}
+
+// Reads one pair object's fields; anything that isn't a number, or a key
+// outside the schema, is skipped. A pair cut short by malformed or truncated
+// input isn't counted.
+static void read_pair(JsonReader *reader, PairColumns *out) {
+  size_t row = out->count;
+  JsonString key;
+  while (!reader->failed && json_next_field(reader, &key)) {
+    if (json_peek(reader) != JsonType::NUMBER) {
+      json_skip_value(reader);
+      continue;
+    }
+
+    KeyId id = resolve_key(key.data, key.length);
+    if (id == KEY_WEIGHT && !out->weights) {
+      out->weights = (f64 *)reserve_buffer(out->capacity * sizeof(f64),
+                                           out->buffers);
+      point_key_columns(out);
+    } else if (id == KEY_ID && !out->ids) {
+      out->ids = (f64 *)reserve_buffer(out->capacity * sizeof(f64),
+                                       out->buffers);
+      point_key_columns(out);
+    }
+
+    KeyColumn column = out->columns[id];
+    f64 value = json_read_number(reader);
+    if (column.base) {
+      column.base[row * column.stride] = value;
+    }
+  }
+  if (!reader->failed) {
+    out->count++;
+  }
+}
+
+// Reads the elements of the pairs array, up to and including its ']'. Stops
+// at the first malformed value.
+static void read_pairs(JsonReader *reader, PairColumns *out) {
+  TRACE_BLOCK("pairs");
+  while (!reader->failed && json_next_element(reader)) {
+    if (json_peek(reader) != JsonType::OBJECT) {
+      json_skip_value(reader);
+      continue;
+    }
+    if (out->count == out->capacity) {
+      grow_pair_columns(out);
+    }
+    json_enter_object(reader);
+    read_pair(reader, out);
+    if (!reader->failed) {
+      out->last_pair_end = reader->pos;
+    }
+  }
+}
+
+Output parse(const char *filename, ReadOptions *options) {
+
+  TRACE_FUNC;
+
+  // "-" is stdin, which may be a pipe.
+  int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+  struct stat stat_res;
+  if (fd < 0 || fstat(fd, &stat_res) != 0) {
+    fprintf(stderr, "Error opening %s\n", filename);
+    exit(1);
+  }
+  bool stream = !S_ISREG(stat_res.st_mode);
+  long resume_offset = stream ? 0 : options->resume_offset;
+  if (resume_offset > stat_res.st_size) {
+    resume_offset = stat_res.st_size;
+  }
+  long total_size = stat_res.st_size - resume_offset;
+
+  Compression format = detect_compression(fd);
+  if (!compression_supported(format)) {
+    fprintf(stderr, "%s is %s compressed, but this build has no %s support\n",
+            filename, compression_name(format), compression_name(format));
+    exit(1);
+  }
+
+  char *buffer;
+  ReadPipeline pipeline;
+  DecompressStage stage;
+  size_t max_pairs;
+  if (format != Compression::NONE) {
+    // Offsets inside the decoded stream mean nothing in the file.
+    resume_offset = 0;
+    size_t compressed_size = stat_res.st_size;
+    size_t capacity =
+        compressed_size * DECOMPRESS_RESERVE_RATIO + options->chunk_size;
+    buffer = (char *)reserve_buffer(capacity + KEY_LOAD_PADDING,
+                                    &options->buffers);
+    u32 thread_count = options->decompress_threads;
+    if (thread_count == 0) {
+      thread_count = std::thread::hardware_concurrency();
+    }
+    start_decompress_stage(&stage, &pipeline, fd, format, compressed_size,
+                           buffer, capacity, options->chunk_size,
+                           thread_count ? thread_count : 1);
+    max_pairs = INITIAL_PAIR_CAPACITY;
+  } else if (stream) {
+    buffer = (char *)reserve_buffer(STREAM_RESERVE + KEY_LOAD_PADDING,
+                                    &options->buffers);
+    start_stream_pipeline(&pipeline, fd, buffer, STREAM_RESERVE,
+                          options->chunk_size);
+    max_pairs = INITIAL_PAIR_CAPACITY;
+  } else {
+    // Only the parser reads the file image, so it is prefaulted by this
+    // thread alone: striping it over the reduction workers' threads would
+    // first-touch it onto their nodes.
+    BufferOptions file_options = options->buffers;
+    if (file_options.prefault_threads) {
+      file_options.prefault_threads = 1;
+    }
+    buffer = (char *)alloc_buffer(total_size + KEY_LOAD_PADDING, &file_options);
+    TRACE_BANDWIDTH("read file", options->mode == ReadMode::SYNC ? total_size : 0);
+    start_read_pipeline(&pipeline, fd, buffer, resume_offset, total_size,
+                        options->chunk_size, options->depth, options->mode);
+    max_pairs = total_size / 4;
+  }
+
+  // A file's size bounds its pair count, so its columns are sized up front;
+  // stream and compressed input start small and grow.
+  PairColumns out = {};
+  out.pairs = (double (*)[4])alloc_buffer(max_pairs * sizeof(*out.pairs),
+                                          &options->buffers);
+  out.capacity = max_pairs;
+  out.buffers = &options->buffers;
+  point_key_columns(&out);
+
+  JsonReader reader = {buffer, 0, 0, refill_from_pipeline, &pipeline, false};
+  if (resume_offset > 0) {
+    // Positioned just past a pair inside the array.
+    read_pairs(&reader, &out);
+  } else if (json_enter_object(&reader)) {
+    JsonString key;
+    while (!reader.failed && json_next_field(&reader, &key)) {
+      if (resolve_key(key.data, key.length) == KEY_PAIRS &&
+          json_peek(&reader) == JsonType::ARRAY) {
+        json_enter_array(&reader);
+        read_pairs(&reader, &out);
+      } else {
+        json_skip_value(&reader);
+      }
+    }
+  }
+  if (reader.failed) {
+    fprintf(stderr, "Malformed or truncated JSON near byte %zu of %s\n",
+            resume_offset + reader.pos, filename);
+  }
+  total_size = pipeline.total_size; // shrinks if a read failed
+  bool incomplete = reader.failed || pipeline.failed;
+  long last_pair_end =
+      out.count ? resume_offset + out.last_pair_end : resume_offset;
+
+  finish_read_pipeline(&pipeline);
+  close(fd);
+
+  if (format != Compression::NONE) {
+    f64 frequency = (f64)get_cpu_timer_frequency();
+    f64 read_seconds = (f64)stage.read_ticks / frequency;
+    f64 decode_seconds = (f64)stage.decompress_ticks / frequency;
+    f64 stage_seconds =
+        (f64)(pipeline.read_end - pipeline.read_start) / frequency;
+    printf("Decompress (%s, %u frames, %u in parallel, %u threads): "
+           "%zu -> %ld bytes, read %.4fs, decode %.4fs (summed), stage "
+           "%.4fs%s\n",
+           compression_name(format), stage.frame_count, stage.parallel_frames,
+           stage.thread_count, stage.input_size, total_size, read_seconds,
+           decode_seconds, stage_seconds,
+           pipeline.failed ? " (failed)" : "");
+    TRACE_EXTERNAL("read compressed", stage.read_ticks, stage.input_size);
+    TRACE_EXTERNAL("decompress", stage.decompress_ticks, total_size);
+    finish_decompress_stage(&stage);
+  } else if (stream) {
+    f64 read_seconds = (f64)(pipeline.read_end - pipeline.read_start) /
+                       (f64)get_cpu_timer_frequency();
+    printf("Read stream (%zukb chunks): %.4fs, %.2fGbps%s\n",
+           pipeline.chunk_size / 1024, read_seconds,
+           (f64)total_size / (1024. * 1024. * 1024.) / read_seconds,
+           pipeline.failed ? " (read failed)" : "");
+  } else if (pipeline.mode != ReadMode::SYNC) {
+    f64 read_seconds = (f64)(pipeline.read_end - pipeline.read_start) /
+                       (f64)get_cpu_timer_frequency();
+    printf("Read pipeline (%s, %zukb chunks, depth %u): %.4fs, %.2fGbps%s\n",
+           read_mode_name(pipeline.mode), pipeline.chunk_size / 1024,
+           pipeline.depth, read_seconds,
+           (f64)total_size / (1024. * 1024. * 1024.) / read_seconds,
+           pipeline.failed ? " (read failed)" : "");
+  }
+
+  free_buffer(buffer);
+
+  return {out.count, total_size, out.pairs, out.weights, out.ids,
+          last_pair_end, incomplete};
+}
@@ -0,0 +1,240 @@
+// Cheaper haversine variants for when a few digits of the mean are enough.
+//
+//   f64    ReferenceHaversine on the parsed doubles (the default).
+//   mixed  coordinates stored as f32, f64 math and accumulation. Halves the
+//          bytes streamed per pair; the error comes only from rounding inputs.
+//   f32    f32 storage, f32 libm trig and f32 accumulation in 8 lanes.
+//   table  f64 storage, sin/cos from a 256 entry table plus a short
+//          polynomial, and a polynomial asin.
+
+enum class Precision {
+  F64,
+  MIXED,
+  F32,
+  TABLE,
+  COUNT,
+};
+
+static const char *precision_names[(int)Precision::COUNT] = {"f64", "mixed",
+                                                             "f32", "table"};
+
+static bool parse_precision(const char *name, Precision *precision) {
+  for (int i = 0; i < (int)Precision::COUNT; ++i) {
+    if (strcmp(name, precision_names[i]) == 0) {
+      *precision = (Precision)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static f32 HaversineF32(f32 X0, f32 Y0, f32 X1, f32 Y1, f32 EarthRadius) {
+  const f32 radians = 0.01745329251994329577f;
+  f32 dLat = radians * (Y1 - Y0);
+  f32 dLon = radians * (X1 - X0);
+  f32 lat1 = radians * Y0;
+  f32 lat2 = radians * Y1;
+  f32 sinLat = sinf(dLat / 2.0f);
+  f32 sinLon = sinf(dLon / 2.0f);
+  f32 a = sinLat * sinLat + cosf(lat1) * cosf(lat2) * sinLon * sinLon;
+  return EarthRadius * 2.0f * asinf(sqrtf(a));
+}
+
+// sin/cos are looked up at the nearest of TRIG_TABLE_SIZE points around the
+// circle and corrected with the angle-sum identity. The remainder is at most
+// pi/256, so two polynomial terms each keep the error near 1e-12 and the
+// asin series is what limits this mode.
+#define TRIG_TABLE_SIZE 256
+#define TWO_PI 6.28318530717958647692
+
+static f64 trig_table_sin[TRIG_TABLE_SIZE];
+static f64 trig_table_cos[TRIG_TABLE_SIZE];
+
+static void init_trig_table() {
+  for (int i = 0; i < TRIG_TABLE_SIZE; ++i) {
+    trig_table_sin[i] = sin(i * (TWO_PI / TRIG_TABLE_SIZE));
+    trig_table_cos[i] = cos(i * (TWO_PI / TRIG_TABLE_SIZE));
+  }
+}
+
+static void table_sincos(f64 x, f64 *sin_x, f64 *cos_x) {
+  f64 k = nearbyint(x * (TRIG_TABLE_SIZE / TWO_PI));
+  f64 d = x - k * (TWO_PI / TRIG_TABLE_SIZE);
+  u32 index = (u32)(int64_t)k & (TRIG_TABLE_SIZE - 1);
+
+  f64 d2 = d * d;
+  f64 sin_d = d * (1.0 - d2 * (1.0 / 6.0));
+  f64 cos_d = 1.0 - d2 * (0.5 - d2 * (1.0 / 24.0));
+  *sin_x = trig_table_sin[index] * cos_d + trig_table_cos[index] * sin_d;
+  *cos_x = trig_table_cos[index] * cos_d - trig_table_sin[index] * sin_d;
+}
+
+// asin on [0, 1]. Taylor series up to x^17 below 0.5; above it,
+// asin(x) = pi/2 - 2 asin(sqrt((1 - x) / 2)) folds the argument back under 0.5.
+static f64 asin_series(f64 x) {
+  f64 x2 = x * x;
+  f64 p = 6435.0 / 557056.0;
+  p = p * x2 + 143.0 / 10240.0;
+  p = p * x2 + 231.0 / 13312.0;
+  p = p * x2 + 63.0 / 2816.0;
+  p = p * x2 + 35.0 / 1152.0;
+  p = p * x2 + 5.0 / 112.0;
+  p = p * x2 + 3.0 / 40.0;
+  p = p * x2 + 1.0 / 6.0;
+  return x + x * x2 * p;
+}
+
+static f64 table_asin(f64 x) {
+  if (x <= 0.5) {
+    return asin_series(x);
+  }
+  return TWO_PI / 4.0 - 2.0 * asin_series(sqrt((1.0 - x) * 0.5));
+}
+
+static f64 HaversineTable(f64 X0, f64 Y0, f64 X1, f64 Y1, f64 EarthRadius) {
+  // Same f32-rounded constant as ReferenceHaversine, so only the trig differs.
+  const f64 radians = 0.01745329251994329577f;
+  f64 sinLat, cosDLat, sinLon, cosDLon, sin1, cos1, sin2, cos2;
+  table_sincos(radians * (Y1 - Y0) / 2.0, &sinLat, &cosDLat);
+  table_sincos(radians * (X1 - X0) / 2.0, &sinLon, &cosDLon);
+  table_sincos(radians * Y0, &sin1, &cos1);
+  table_sincos(radians * Y1, &sin2, &cos2);
+  f64 a = sinLat * sinLat + cos1 * cos2 * sinLon * sinLon;
+  return EarthRadius * 2.0 * table_asin(sqrt(a));
+}
+
+// Copy of the pair coordinates rounded to f32, for the mixed and f32 modes.
+static f32 *narrow_pairs(Output *output) {
+  f32 *narrow = new f32[output->num_pairs * 4];
+  for (size_t i = 0; i < output->num_pairs * 4; ++i) {
+    narrow[i] = (f32)output->pairs[i / 4][i % 4];
+  }
+  return narrow;
+}
+
+template <Precision P>
+static f64 pair_distance(Output *output, f32 *narrow, size_t i) {
+  switch (P) {
+  case Precision::MIXED:
+    return ReferenceHaversine(narrow[i * 4 + 0], narrow[i * 4 + 1],
+                              narrow[i * 4 + 2], narrow[i * 4 + 3], 6372.8);
+  case Precision::F32:
+    return HaversineF32(narrow[i * 4 + 0], narrow[i * 4 + 1],
+                        narrow[i * 4 + 2], narrow[i * 4 + 3], 6372.8f);
+  case Precision::TABLE:
+    return HaversineTable(output->pairs[i][0], output->pairs[i][1],
+                          output->pairs[i][2], output->pairs[i][3], 6372.8);
+  default:
+    return ReferenceHaversine(output->pairs[i][0], output->pairs[i][1],
+                              output->pairs[i][2], output->pairs[i][3], 6372.8);
+  }
+}
+
+template <Precision P> static f64 average_with(Output *output, f32 *narrow) {
+  size_t count = output->num_pairs;
+  if (count == 0) {
+    return 0.0;
+  }
+
+  if (P == Precision::F32) {
+    f32 lanes[8] = {};
+    for (size_t i = 0; i < count; ++i) {
+      lanes[i & 7] += (f32)pair_distance<P>(output, narrow, i);
+    }
+    f32 sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+              ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+    return sum / (f32)count;
+  }
+
+  f64 sum = 0.0;
+  for (size_t i = 0; i < count; ++i) {
+    sum += pair_distance<P>(output, narrow, i);
+  }
+  return sum / (f64)count;
+}
+
+static f64 average_for_precision(Output *output, f32 *narrow,
+                                 Precision precision) {
+  TRACE_FUNC;
+
+  switch (precision) {
+  case Precision::MIXED:
+    return average_with<Precision::MIXED>(output, narrow);
+  case Precision::F32:
+    return average_with<Precision::F32>(output, narrow);
+  case Precision::TABLE:
+    return average_with<Precision::TABLE>(output, narrow);
+  default:
+    return average_with<Precision::F64>(output, narrow);
+  }
+}
+
+template <Precision P>
+static void pair_errors(Output *output, f32 *narrow, f64 *reference,
+                        f64 *max_error, f64 *mean_error) {
+  f64 max = 0.0;
+  f64 sum = 0.0;
+  for (size_t i = 0; i < output->num_pairs; ++i) {
+    f64 error = fabs(pair_distance<P>(output, narrow, i) - reference[i]);
+    max = error > max ? error : max;
+    sum += error;
+  }
+  *max_error = max;
+  *mean_error = output->num_pairs ? sum / output->num_pairs : 0.0;
+}
+
+// Runs every mode over the parsed pairs and prints, next to its throughput,
+// how far each one lands from the f64 reference: per pair (max and mean
+// absolute error in km) and for the final mean.
+static void print_precision_report(Output *output) {
+  TRACE_FUNC;
+
+  size_t count = output->num_pairs;
+  f32 *narrow = narrow_pairs(output);
+  f64 *reference = new f64[count];
+  for (size_t i = 0; i < count; ++i) {
+    reference[i] = pair_distance<Precision::F64>(output, narrow, i);
+  }
+  f64 reference_mean = average_with<Precision::F64>(output, narrow);
+
+  printf("Precision report over %zu pairs (errors in km vs f64):\n", count);
+  for (int mode = 0; mode < (int)Precision::COUNT; ++mode) {
+    Precision precision = (Precision)mode;
+
+    u64 best = ~0ull;
+    f64 mean = 0.0;
+    for (int run = 0; run < 3; ++run) {
+      u64 start = read_cpu_timer();
+      mean = average_for_precision(output, narrow, precision);
+      u64 elapsed = read_cpu_timer() - start;
+      best = elapsed < best ? elapsed : best;
+    }
+    f64 seconds = (f64)best / (f64)get_cpu_timer_frequency();
+
+    f64 max_error = 0.0, mean_error = 0.0;
+    switch (precision) {
+    case Precision::MIXED:
+      pair_errors<Precision::MIXED>(output, narrow, reference, &max_error,
+                                    &mean_error);
+      break;
+    case Precision::F32:
+      pair_errors<Precision::F32>(output, narrow, reference, &max_error,
+                                  &mean_error);
+      break;
+    case Precision::TABLE:
+      pair_errors<Precision::TABLE>(output, narrow, reference, &max_error,
+                                    &mean_error);
+      break;
+    default:
+      break;
+    }
+
+    printf("  %-6s mean %.17g (off by %.3g), pair error max %.3g mean %.3g, "
+           "%.4fs, %.1f Mpairs/s\n",
+           precision_names[mode], mean, fabs(mean - reference_mean), max_error,
+           mean_error, seconds, seconds > 0 ? count / seconds / 1e6 : 0.0);
+  }
+
+  delete[] reference;
+  delete[] narrow;
+}
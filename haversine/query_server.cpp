@@ -0,0 +1,586 @@
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <vector>
+
+#define PROFILE 1
+
+typedef double f64;
+#include "../computer_enhance/perfaware/part2/listing_0065_haversine_formula.cpp"
+#include "../timing/time.cc"
+#include "parse_pairs.cpp"
+#include "distribution.cpp"
+
+// Resident haversine query server. Datasets are parsed once and their
+// distances precomputed; clients then send batches of queries over a Unix
+// domain socket and get one response per query back.
+//
+// Wire format (native endian, both directions): a FrameHeader followed by
+// `count` records. Each QueryResponse is followed by `value_count` u64s
+// (histogram bins, or latency percentiles for QUERY_STATS).
+
+#define QUERY_MAGIC 0x59525148   // "HQRY"
+#define RESPONSE_MAGIC 0x50535248 // "HRSP"
+#define MAX_BATCH 4096
+#define MAX_BINS 1024
+#define MAX_DATASETS 256 // QueryRequest.dataset is a byte
+#define MAX_CLIENTS 64
+
+enum QueryOp : uint8_t {
+  QUERY_AVERAGE,
+  QUERY_SUM,
+  QUERY_MINMAX,
+  QUERY_HISTOGRAM,
+  QUERY_STATS,
+  QUERY_SHUTDOWN,
+};
+
+enum QueryStatus : uint8_t {
+  STATUS_OK,
+  STATUS_BAD_DATASET,
+  STATUS_BAD_RANGE,
+  STATUS_BAD_OP,
+};
+
+struct FrameHeader {
+  u32 magic;
+  u32 count;
+};
+
+struct QueryRequest {
+  uint8_t op;
+  uint8_t dataset;
+  uint16_t bins;
+  u32 reserved;
+  u64 begin; // pair index range [begin, end); end == 0 means all pairs
+  u64 end;
+};
+
+struct QueryResponse {
+  uint8_t op;
+  uint8_t status;
+  uint16_t value_count;
+  u32 reserved;
+  u64 pair_count;
+  f64 a; // average, sum or min
+  f64 b; // max
+};
+
+struct Dataset {
+  const char *name;
+  size_t count;
+  f64 *distances;
+  f64 *prefix_sums; // prefix_sums[i] = sum of distances[0, i)
+};
+
+static std::vector<Dataset> DATASETS;
+// Per-request latency in milliseconds, so the sketch's 2^-20..2^15 range
+// covers ~1ns to ~30s. Fixed size however long the daemon runs.
+static QuantileSketch LATENCIES;
+static u64 MAX_LATENCY; // exact, in CPU timer ticks
+static volatile sig_atomic_t STOP_SERVER;
+
+static Dataset load_dataset(const char *filename) {
+  ReadOptions options = {HAVE_IO_URING ? ReadMode::URING : ReadMode::PREAD,
+                         1024 * 1024, 4, 0, {}, 0};
+  Output output = parse(filename, &options);
+
+  Dataset dataset = {filename, output.num_pairs, new f64[output.num_pairs],
+                     new f64[output.num_pairs + 1]};
+  dataset.prefix_sums[0] = 0.0;
+  for (size_t i = 0; i < output.num_pairs; ++i) {
+    dataset.distances[i] =
+        ReferenceHaversine(output.pairs[i][0], output.pairs[i][1],
+                           output.pairs[i][2], output.pairs[i][3], 6372.8);
+    dataset.prefix_sums[i + 1] = dataset.prefix_sums[i] + dataset.distances[i];
+  }
+
+  free_buffer(output.pairs);
+  free_buffer(output.weights);
+  free_buffer(output.ids);
+  return dataset;
+}
+
+static u64 ticks_to_ns(u64 ticks) {
+  return (u64)((f64)ticks * 1e9 / (f64)get_cpu_timer_frequency());
+}
+
+static void record_latency(u64 ticks) {
+  record_sketch(&LATENCIES,
+                (f64)ticks * 1e3 / (f64)get_cpu_timer_frequency());
+  if (ticks > MAX_LATENCY) {
+    MAX_LATENCY = ticks;
+  }
+}
+
+// Within 0.4% of the exact percentile (see distribution.cpp).
+static u64 latency_percentile_ns(f64 percentile) {
+  return (u64)(sketch_quantile(&LATENCIES, percentile) * 1e6);
+}
+
+// Answers one query into response/values; returns the number of values.
+static uint16_t answer_query(const QueryRequest &request,
+                             QueryResponse &response, u64 *values) {
+  response = {};
+  response.op = request.op;
+
+  if (request.op == QUERY_STATS) {
+    values[0] = latency_percentile_ns(0.50);
+    values[1] = latency_percentile_ns(0.90);
+    values[2] = latency_percentile_ns(0.99);
+    values[3] = ticks_to_ns(MAX_LATENCY);
+    response.pair_count = LATENCIES.count;
+    return response.value_count = 4;
+  }
+
+  if (request.op == QUERY_SHUTDOWN) {
+    STOP_SERVER = 1;
+    return 0;
+  }
+
+  if (request.dataset >= DATASETS.size()) {
+    response.status = STATUS_BAD_DATASET;
+    return 0;
+  }
+
+  const Dataset &dataset = DATASETS[request.dataset];
+  u64 begin = request.begin;
+  u64 end = request.end ? request.end : dataset.count;
+  if (begin >= end || end > dataset.count) {
+    response.status = STATUS_BAD_RANGE;
+    return 0;
+  }
+  response.pair_count = end - begin;
+
+  switch (request.op) {
+  case QUERY_AVERAGE:
+  case QUERY_SUM: {
+    f64 sum = dataset.prefix_sums[end] - dataset.prefix_sums[begin];
+    response.a =
+        request.op == QUERY_SUM ? sum : sum / (f64)response.pair_count;
+    return 0;
+  }
+  case QUERY_MINMAX:
+  case QUERY_HISTOGRAM: {
+    f64 min = dataset.distances[begin];
+    f64 max = dataset.distances[begin];
+    for (u64 i = begin; i < end; ++i) {
+      min = fmin(min, dataset.distances[i]);
+      max = fmax(max, dataset.distances[i]);
+    }
+    response.a = min;
+    response.b = max;
+    if (request.op == QUERY_MINMAX) {
+      return 0;
+    }
+
+    uint16_t bins = request.bins ? request.bins : 16;
+    if (bins > MAX_BINS) {
+      bins = MAX_BINS;
+    }
+    memset(values, 0, bins * sizeof(u64));
+    f64 scale = max > min ? (f64)bins / (max - min) : 0.0;
+    for (u64 i = begin; i < end; ++i) {
+      u64 bin = (u64)((dataset.distances[i] - min) * scale);
+      values[bin < bins ? bin : bins - 1]++;
+    }
+    return response.value_count = bins;
+  }
+  default:
+    response.status = STATUS_BAD_OP;
+    return 0;
+  }
+}
+
+// Blocking helpers for the client. Both return false once the peer is gone
+// (EOF, EPIPE, ECONNRESET) or on any other error.
+static bool read_full(int fd, void *data, size_t size) {
+  char *bytes = (char *)data;
+  while (size) {
+    ssize_t got = read(fd, bytes, size);
+    if (got <= 0) {
+      return false;
+    }
+    bytes += got;
+    size -= got;
+  }
+  return true;
+}
+
+static bool write_full(int fd, const void *data, size_t size) {
+  const char *bytes = (const char *)data;
+  while (size) {
+    ssize_t sent = write(fd, bytes, size);
+    if (sent <= 0) {
+      return false;
+    }
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// Answers one request frame (`count` requests) into reply.
+static void answer_frame(const char *frame, u32 count,
+                         std::vector<char> &reply) {
+  static QueryRequest requests[MAX_BATCH];
+  static u64 values[MAX_BINS];
+  memcpy(requests, frame, count * sizeof(QueryRequest));
+
+  FrameHeader reply_header = {RESPONSE_MAGIC, count};
+  reply.insert(reply.end(), (char *)&reply_header,
+               (char *)&reply_header + sizeof(reply_header));
+
+  for (u32 i = 0; i < count; ++i) {
+    u64 t0 = read_cpu_timer();
+    QueryResponse response;
+    uint16_t value_count = answer_query(requests[i], response, values);
+    record_latency(read_cpu_timer() - t0);
+
+    reply.insert(reply.end(), (char *)&response,
+                 (char *)&response + sizeof(response));
+    reply.insert(reply.end(), (char *)values, (char *)(values + value_count));
+  }
+}
+
+// One connection. Sockets are non-blocking: requests accumulate in `input`
+// until a whole frame is there, and replies drain from `output` as the
+// client reads them. No more input is read while a reply is pending, so a
+// client that doesn't read can't grow the server's buffers.
+struct Client {
+  int fd;
+  std::vector<char> input;
+  std::vector<char> output;
+  size_t output_sent;
+};
+
+// Returns false when the client is gone or sent a bad frame.
+static bool client_readable(Client &client) {
+  char bytes[64 * 1024];
+  ssize_t got = read(client.fd, bytes, sizeof(bytes));
+  if (got < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  if (got == 0) {
+    return false;
+  }
+  client.input.insert(client.input.end(), bytes, bytes + got);
+
+  size_t used = 0;
+  while (client.input.size() - used >= sizeof(FrameHeader)) {
+    FrameHeader header;
+    memcpy(&header, client.input.data() + used, sizeof(header));
+    if (header.magic != QUERY_MAGIC || header.count > MAX_BATCH) {
+      return false;
+    }
+    size_t frame_size = sizeof(header) + header.count * sizeof(QueryRequest);
+    if (client.input.size() - used < frame_size) {
+      break;
+    }
+    answer_frame(client.input.data() + used + sizeof(header), header.count,
+                 client.output);
+    used += frame_size;
+  }
+  client.input.erase(client.input.begin(), client.input.begin() + used);
+  return true;
+}
+
+// Returns false when the client is gone.
+static bool client_writable(Client &client) {
+  ssize_t sent = write(client.fd, client.output.data() + client.output_sent,
+                       client.output.size() - client.output_sent);
+  if (sent < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  client.output_sent += sent;
+  if (client.output_sent == client.output.size()) {
+    client.output.clear();
+    client.output_sent = 0;
+  }
+  return true;
+}
+
+// Serves every client from one thread until STOP_SERVER. poll() returns on
+// SIGINT/SIGTERM (installed without SA_RESTART), so shutdown never waits on
+// an idle client.
+static void serve_clients(int listener) {
+  std::vector<Client> clients;
+  std::vector<pollfd> fds;
+  while (!STOP_SERVER) {
+    fds.assign(1, {listener, POLLIN, 0});
+    for (Client &client : clients) {
+      short events = client.output.empty() ? POLLIN : POLLOUT;
+      fds.push_back({client.fd, events, 0});
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      continue; // EINTR: check STOP_SERVER
+    }
+
+    // Clients first: fds[i + 1] belongs to clients[i] until accept appends.
+    size_t kept = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      Client &client = clients[i];
+      short revents = fds[i + 1].revents;
+      bool alive = true;
+      if (revents & POLLOUT) {
+        alive = client_writable(client);
+      } else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        alive = client_readable(client);
+      }
+      if (alive) {
+        if (kept != i) {
+          clients[kept] = std::move(client);
+        }
+        kept++;
+      } else {
+        close(client.fd);
+      }
+    }
+    clients.resize(kept);
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd >= 0 && clients.size() == MAX_CLIENTS) {
+        close(fd);
+      } else if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        clients.push_back({fd, {}, {}, 0});
+      }
+    }
+  }
+
+  // A shutdown request's own reply is usually still pending.
+  for (Client &client : clients) {
+    if (!client.output.empty()) {
+      client_writable(client);
+    }
+    close(client.fd);
+  }
+}
+
+static int connect_socket(const char *path, bool listen_on) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+  if (listen_on) {
+    unlink(path);
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, 16) != 0) {
+      return -1;
+    }
+  } else if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    return -1;
+  }
+  return fd;
+}
+
+static void print_latency_report() {
+  printf("Served %llu requests: p50 %lluns, p90 %lluns, p99 %lluns, max %lluns\n",
+         (unsigned long long)LATENCIES.count,
+         (unsigned long long)latency_percentile_ns(0.50),
+         (unsigned long long)latency_percentile_ns(0.90),
+         (unsigned long long)latency_percentile_ns(0.99),
+         (unsigned long long)ticks_to_ns(MAX_LATENCY));
+}
+
+static void handle_stop(int) { STOP_SERVER = 1; }
+
+static int run_server(const char *socket_path, int dataset_count,
+                      char **dataset_files) {
+  if (dataset_count > MAX_DATASETS) {
+    fprintf(stderr, "At most %d datasets\n", MAX_DATASETS);
+    return 1;
+  }
+  begin_profile();
+  for (int i = 0; i < dataset_count; ++i) {
+    TRACE_BLOCK("load dataset");
+    DATASETS.push_back(load_dataset(dataset_files[i]));
+    printf("dataset %d: %s (%zu pairs)\n", i, dataset_files[i],
+           DATASETS.back().count);
+  }
+  end_profile();
+
+  int listener = connect_socket(socket_path, true);
+  if (listener < 0) {
+    fprintf(stderr, "Error listening on %s\n", socket_path);
+    return 1;
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = handle_stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &action, nullptr);
+
+  printf("Listening on %s\n", socket_path);
+  fflush(stdout);
+  serve_clients(listener);
+
+  close(listener);
+  unlink(socket_path);
+  print_latency_report();
+  return 0;
+}
+
+// Queries are written as dataset:op[:begin:end[:bins]] with op one of
+// avg, sum, minmax, hist, or just "stats" / "shutdown".
+static bool parse_query(const char *text, QueryRequest &request) {
+  request = {};
+  if (strcmp(text, "stats") == 0) {
+    request.op = QUERY_STATS;
+    return true;
+  }
+  if (strcmp(text, "shutdown") == 0) {
+    request.op = QUERY_SHUTDOWN;
+    return true;
+  }
+
+  unsigned dataset = 0, bins = 0;
+  unsigned long long begin = 0, end = 0;
+  char op[16];
+  if (sscanf(text, "%u:%15[a-z]:%llu:%llu:%u", &dataset, op, &begin, &end,
+             &bins) < 2 ||
+      dataset >= MAX_DATASETS) {
+    return false;
+  }
+
+  request.dataset = dataset;
+  request.begin = begin;
+  request.end = end;
+  request.bins = bins;
+  if (strcmp(op, "avg") == 0) {
+    request.op = QUERY_AVERAGE;
+  } else if (strcmp(op, "sum") == 0) {
+    request.op = QUERY_SUM;
+  } else if (strcmp(op, "minmax") == 0) {
+    request.op = QUERY_MINMAX;
+  } else if (strcmp(op, "hist") == 0) {
+    request.op = QUERY_HISTOGRAM;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static const char *STATUS_NAMES[] = {"ok", "bad dataset", "bad range",
+                                     "bad op"};
+
+static int run_client(const char *socket_path, int query_count,
+                      char **queries) {
+  if (query_count > MAX_BATCH) {
+    fprintf(stderr, "At most %d queries per batch\n", MAX_BATCH);
+    return 1;
+  }
+
+  std::vector<char> frame(sizeof(FrameHeader) +
+                          query_count * sizeof(QueryRequest));
+  FrameHeader *header = (FrameHeader *)frame.data();
+  QueryRequest *requests = (QueryRequest *)(header + 1);
+  header->magic = QUERY_MAGIC;
+  header->count = query_count;
+  for (int i = 0; i < query_count; ++i) {
+    if (!parse_query(queries[i], requests[i])) {
+      fprintf(stderr, "Bad query %s\n", queries[i]);
+      return 1;
+    }
+  }
+
+  int server = connect_socket(socket_path, false);
+  if (server < 0) {
+    fprintf(stderr, "Error connecting to %s\n", socket_path);
+    return 1;
+  }
+
+  u64 t0 = read_cpu_timer();
+  FrameHeader reply;
+  if (!write_full(server, frame.data(), frame.size()) ||
+      !read_full(server, &reply, sizeof(reply)) ||
+      reply.magic != RESPONSE_MAGIC) {
+    fprintf(stderr, "Bad reply from server\n");
+    return 1;
+  }
+
+  if (reply.count != (u32)query_count) {
+    fprintf(stderr, "Bad reply from server\n");
+    return 1;
+  }
+
+  static u64 values[MAX_BINS];
+  for (u32 i = 0; i < reply.count; ++i) {
+    QueryResponse response;
+    if (!read_full(server, &response, sizeof(response)) ||
+        response.value_count > MAX_BINS ||
+        !read_full(server, values, response.value_count * sizeof(u64))) {
+      fprintf(stderr, "Truncated reply from server\n");
+      return 1;
+    }
+
+    printf("%s: ", queries[i]);
+    if (response.status != STATUS_OK) {
+      u32 status_count = sizeof(STATUS_NAMES) / sizeof(STATUS_NAMES[0]);
+      printf("error (%s)\n", response.status < status_count
+                                 ? STATUS_NAMES[response.status]
+                                 : "unknown status");
+      continue;
+    }
+
+    switch (response.op) {
+    case QUERY_AVERAGE:
+    case QUERY_SUM:
+      printf("%.17g over %llu pairs\n", response.a,
+             (unsigned long long)response.pair_count);
+      break;
+    case QUERY_MINMAX:
+      printf("min %.17g max %.17g over %llu pairs\n", response.a, response.b,
+             (unsigned long long)response.pair_count);
+      break;
+    case QUERY_HISTOGRAM: {
+      printf("%u bins over [%.6g, %.6g], %llu pairs:", response.value_count,
+             response.a, response.b, (unsigned long long)response.pair_count);
+      for (u32 bin = 0; bin < response.value_count; ++bin) {
+        printf(" %llu", (unsigned long long)values[bin]);
+      }
+      printf("\n");
+      break;
+    }
+    case QUERY_STATS:
+      printf("%llu requests served: p50 %lluns, p90 %lluns, p99 %lluns, max "
+             "%lluns\n",
+             (unsigned long long)response.pair_count,
+             (unsigned long long)values[0], (unsigned long long)values[1],
+             (unsigned long long)values[2], (unsigned long long)values[3]);
+      break;
+    default:
+      printf("ok\n");
+      break;
+    }
+  }
+  u64 t1 = read_cpu_timer();
+  printf("Round trip: %.1fus for %d queries\n",
+         (f64)(t1 - t0) * 1e6 / (f64)get_cpu_timer_frequency(), query_count);
+
+  close(server);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 4 && strcmp(argv[1], "serve") == 0) {
+    return run_server(argv[2], argc - 3, argv + 3);
+  }
+  if (argc >= 4 && strcmp(argv[1], "query") == 0) {
+    return run_client(argv[2], argc - 3, argv + 3);
+  }
+
+  fprintf(stderr,
+          "Usage: %s serve [socket] [dataset.json...]\n"
+          "       %s query [socket] [dataset:avg|sum|minmax|hist[:begin:end"
+          "[:bins]]|stats|shutdown...]\n",
+          argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,415 @@
+#include <atomic>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<liburing.h>)
+#include <liburing.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// Reads a file into one contiguous buffer on a background thread so parsing
+// can start on the first chunks while later ones are still in flight. Finished
+// ranges are handed to the parser in file order through a lock-free SPSC queue.
+// Either side blocks on a condition variable when the queue is empty or full;
+// the mutex is only taken around those waits, once per chunk.
+//
+// Pipes and other unseekable inputs go through the same queue, read into a
+// reservation until EOF; see start_stream_pipeline.
+
+template <typename T, size_t N> struct SpscQueue {
+  static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+  T items[N];
+  alignas(64) std::atomic<size_t> head{0}; // next slot the consumer reads
+  alignas(64) std::atomic<size_t> tail{0}; // next slot the producer writes
+
+  bool push(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items[t & (N - 1)] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    item = items[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  }
+};
+
+enum class ReadMode {
+  SYNC,
+  PREAD,
+  URING,
+};
+
+static const char *read_mode_name(ReadMode mode) {
+  switch (mode) {
+  case ReadMode::SYNC:
+    return "sync";
+  case ReadMode::PREAD:
+    return "pread";
+  default:
+    return "uring";
+  }
+}
+
+struct ReadChunk {
+  size_t offset;
+  size_t size;
+};
+
+struct ReadPipeline {
+  int fd;
+  char *buffer;
+  size_t file_offset; // file position of buffer[0]
+  size_t total_size;
+  size_t chunk_size;
+  u32 depth;
+  ReadMode mode;
+
+  SpscQueue<ReadChunk, 256> completed;
+  std::thread reader;
+
+  std::mutex lock;
+  std::condition_variable chunk_ready; // reader -> parser
+  std::condition_variable space_ready; // parser -> reader, and on cancel
+
+  // Set by finish_read_pipeline. A parser that stopped early (malformed
+  // input, full capacity) no longer drains the queue, so the reader gives up
+  // instead of waiting for space.
+  std::atomic<bool> cancelled;
+
+  // Consumer side: bytes known to be in the buffer.
+  size_t available;
+
+  // Reader side timing, in CPU timer ticks.
+  u64 read_start;
+  u64 read_end;
+  bool failed;
+
+  // Stream input only: parsed pages are returned to the OS as the parser
+  // moves on, up to `released`.
+  bool release_parsed;
+  size_t released;
+};
+
+// Returns false once the pipeline is cancelled; the reader should stop.
+static bool publish_chunk(ReadPipeline *pipeline, ReadChunk chunk) {
+  {
+    std::unique_lock<std::mutex> guard(pipeline->lock);
+    while (!pipeline->completed.push(chunk)) {
+      if (pipeline->cancelled) {
+        return false;
+      }
+      pipeline->space_ready.wait(guard);
+    }
+  }
+  pipeline->chunk_ready.notify_one();
+  return true;
+}
+
+static void reset_pipeline_state(ReadPipeline *pipeline) {
+  pipeline->available = 0;
+  pipeline->read_start = pipeline->read_end = 0;
+  pipeline->failed = false;
+  pipeline->cancelled = false;
+  pipeline->released = 0;
+}
+
+static void pread_reader(ReadPipeline *pipeline) {
+  size_t offset = 0;
+  while (offset < pipeline->total_size) {
+    size_t want = pipeline->total_size - offset;
+    if (want > pipeline->chunk_size) {
+      want = pipeline->chunk_size;
+    }
+
+    ssize_t got = pread(pipeline->fd, pipeline->buffer + offset, want,
+                        pipeline->file_offset + offset);
+    if (got <= 0) {
+      pipeline->failed = true;
+      break;
+    }
+    if (!publish_chunk(pipeline, {offset, (size_t)got})) {
+      break;
+    }
+    offset += got;
+  }
+}
+
+#if HAVE_IO_URING
+// Keeps `depth` chunk reads queued at once. Completions arrive out of order,
+// so they are only published once every earlier byte has landed. Short reads
+// are not resubmitted: publishing stops after the bytes that did arrive.
+static void uring_reader(ReadPipeline *pipeline) {
+  io_uring ring;
+  if (io_uring_queue_init(pipeline->depth, &ring, 0) < 0) {
+    pread_reader(pipeline);
+    return;
+  }
+
+  size_t chunk_count =
+      (pipeline->total_size + pipeline->chunk_size - 1) / pipeline->chunk_size;
+  bool *done = new bool[chunk_count]();
+  size_t *read_size = new size_t[chunk_count]();
+  size_t submitted = 0;
+  size_t published = 0;
+  u32 in_flight = 0;
+
+  bool cancelled = false;
+  while (published < chunk_count && !pipeline->failed && !cancelled) {
+    while (in_flight < pipeline->depth && submitted < chunk_count) {
+      size_t offset = submitted * pipeline->chunk_size;
+      size_t size = pipeline->total_size - offset;
+      if (size > pipeline->chunk_size) {
+        size = pipeline->chunk_size;
+      }
+
+      io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_read(sqe, pipeline->fd, pipeline->buffer + offset, size,
+                         pipeline->file_offset + offset);
+      io_uring_sqe_set_data64(sqe, submitted);
+      submitted++;
+      in_flight++;
+    }
+    io_uring_submit(&ring);
+
+    io_uring_cqe *cqe;
+    if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+      pipeline->failed = true;
+      break;
+    }
+
+    size_t chunk = io_uring_cqe_get_data64(cqe);
+    done[chunk] = true;
+    read_size[chunk] = cqe->res > 0 ? (size_t)cqe->res : 0;
+    in_flight--;
+    io_uring_cqe_seen(&ring, cqe);
+
+    while (published < chunk_count && done[published]) {
+      size_t publish_offset = published * pipeline->chunk_size;
+      size_t size = pipeline->total_size - publish_offset;
+      if (size > pipeline->chunk_size) {
+        size = pipeline->chunk_size;
+      }
+      size_t got = read_size[published];
+      if (got && !publish_chunk(pipeline, {publish_offset, got})) {
+        cancelled = true;
+        break;
+      }
+      if (got != size) {
+        pipeline->failed = true;
+        break;
+      }
+      published++;
+    }
+  }
+
+  // The ring can't go away while reads into the buffer are still queued.
+  while (in_flight > 0) {
+    io_uring_cqe *cqe;
+    if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+      break;
+    }
+    io_uring_cqe_seen(&ring, cqe);
+    in_flight--;
+  }
+
+  delete[] read_size;
+  delete[] done;
+  io_uring_queue_exit(&ring);
+}
+#endif
+
+static void run_reader(ReadPipeline *pipeline) {
+  pipeline->read_start = read_cpu_timer();
+#if HAVE_IO_URING
+  if (pipeline->mode == ReadMode::URING) {
+    uring_reader(pipeline);
+  } else
+#endif
+  {
+    pread_reader(pipeline);
+  }
+  pipeline->read_end = read_cpu_timer();
+
+  if (pipeline->failed) {
+    // Let the parser finish on whatever arrived.
+    publish_chunk(pipeline, {pipeline->total_size, 0});
+  }
+}
+
+static void start_read_pipeline(ReadPipeline *pipeline, int fd, char *buffer,
+                                size_t file_offset, size_t total_size,
+                                size_t chunk_size, u32 depth, ReadMode mode) {
+  pipeline->fd = fd;
+  pipeline->buffer = buffer;
+  pipeline->file_offset = file_offset;
+  pipeline->total_size = total_size;
+  pipeline->chunk_size = chunk_size;
+  pipeline->depth = depth;
+  pipeline->mode = mode;
+  pipeline->release_parsed = false;
+  reset_pipeline_state(pipeline);
+
+#if !HAVE_IO_URING
+  if (mode == ReadMode::URING) {
+    pipeline->mode = ReadMode::PREAD;
+  }
+#endif
+
+  if (mode == ReadMode::SYNC) {
+    // One pread for the whole file, done before parsing starts.
+    pipeline->chunk_size = total_size ? total_size : 1;
+    run_reader(pipeline);
+  } else {
+    pipeline->reader = std::thread(run_reader, pipeline);
+  }
+}
+
+static void stream_reader(ReadPipeline *pipeline) {
+  pipeline->read_start = read_cpu_timer();
+  size_t offset = 0;
+  for (;;) {
+    size_t want = pipeline->total_size - offset;
+    if (want == 0) {
+      fprintf(stderr, "Input larger than the %zu byte stream reservation\n",
+              pipeline->total_size);
+      pipeline->failed = true;
+      break;
+    }
+    if (want > pipeline->chunk_size) {
+      want = pipeline->chunk_size;
+    }
+
+    ssize_t got = read(pipeline->fd, pipeline->buffer + offset, want);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      pipeline->failed = got < 0;
+      break;
+    }
+    if (!publish_chunk(pipeline, {offset, (size_t)got})) {
+      break;
+    }
+    offset += got;
+  }
+  pipeline->read_end = read_cpu_timer();
+
+  // The real size is only known now.
+  publish_chunk(pipeline, {offset, 0});
+}
+
+// Reads an unseekable fd (stdin, a pipe) to EOF into `buffer`, which must be
+// a reservation of `capacity` bytes. The pipe is enlarged to a chunk where the
+// OS allows it, so each read moves more per wakeup.
+static void start_stream_pipeline(ReadPipeline *pipeline, int fd, char *buffer,
+                                  size_t capacity, size_t chunk_size) {
+  pipeline->fd = fd;
+  pipeline->buffer = buffer;
+  pipeline->file_offset = 0;
+  pipeline->total_size = capacity;
+  pipeline->chunk_size = chunk_size;
+  pipeline->depth = 1;
+  pipeline->mode = ReadMode::PREAD;
+  pipeline->release_parsed = true;
+  reset_pipeline_state(pipeline);
+
+#if defined(F_SETPIPE_SZ)
+  fcntl(fd, F_SETPIPE_SZ, (int)chunk_size);
+#endif
+  pipeline->reader = std::thread(stream_reader, pipeline);
+}
+
+#define RELEASE_MARGIN (1024 * 1024)
+
+// Streams can be larger than memory. Whole huge pages a margin behind the
+// parser are dropped; the margin keeps the key being resolved in place.
+static void release_parsed_pages(ReadPipeline *pipeline, size_t parsed) {
+  if (parsed < RELEASE_MARGIN) {
+    return;
+  }
+  size_t end = (parsed - RELEASE_MARGIN) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+  if (end > pipeline->released) {
+    madvise(pipeline->buffer + pipeline->released, end - pipeline->released,
+            MADV_DONTNEED);
+    pipeline->released = end;
+  }
+}
+
+// Blocks until more of the file is available and returns how far the parser
+// may go: up to just past the last ',' or '}' read so far, so no token is cut
+// off at the edge of a chunk. Returns total_size once everything is in.
+static size_t wait_for_parse_limit(ReadPipeline *pipeline, size_t parsed) {
+  if (pipeline->release_parsed) {
+    release_parsed_pages(pipeline, parsed);
+  }
+  for (;;) {
+    ReadChunk chunk;
+    bool popped = false;
+    while (pipeline->completed.pop(chunk)) {
+      popped = true;
+      if (chunk.size == 0) {
+        // Reader failed, or a stream ended short of the size guessed up
+        // front; stop at what we have.
+        pipeline->total_size = pipeline->available;
+      } else {
+        pipeline->available = chunk.offset + chunk.size;
+      }
+    }
+    if (popped) {
+      // Taking the lock orders the pops before a reader's full-queue check.
+      { std::lock_guard<std::mutex> guard(pipeline->lock); }
+      pipeline->space_ready.notify_one();
+    }
+
+    if (pipeline->available >= pipeline->total_size) {
+      return pipeline->total_size;
+    }
+
+    size_t limit = pipeline->available;
+    while (limit > parsed && pipeline->buffer[limit - 1] != ',' &&
+           pipeline->buffer[limit - 1] != '}') {
+      limit--;
+    }
+    if (limit > parsed) {
+      return limit;
+    }
+
+    std::unique_lock<std::mutex> guard(pipeline->lock);
+    pipeline->chunk_ready.wait(
+        guard, [pipeline] { return !pipeline->completed.empty(); });
+  }
+}
+
+static void finish_read_pipeline(ReadPipeline *pipeline) {
+  {
+    std::lock_guard<std::mutex> guard(pipeline->lock);
+    pipeline->cancelled = true;
+  }
+  pipeline->space_ready.notify_all();
+  if (pipeline->reader.joinable()) {
+    pipeline->reader.join();
+  }
+}
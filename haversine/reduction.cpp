@@ -0,0 +1,127 @@
+#include <thread>
+
+// Deterministic parallel sum of pair distances. The pairs are cut into fixed
+// blocks that do not depend on the thread count. Each block is summed with
+// Neumaier compensation in independent lanes, and the block partials are
+// combined in one fixed pairwise tree. Threads only decide who computes a
+// block, never how it is added, so the result is bit-identical for any
+// thread count.
+//
+// With a Distribution, each thread also records every distance into its own
+// copy (distribution.cpp), merged at the end; those are integer counts, so
+// they are thread-count independent too.
+
+#define REDUCE_BLOCK 4096
+#define REDUCE_LANES 4
+
+struct Compensated {
+  f64 sum;
+  f64 error; // running low-order bits lost from sum
+};
+
+static inline void neumaier_add(Compensated *acc, f64 value) {
+  f64 sum = acc->sum + value;
+  acc->error += fabs(acc->sum) >= fabs(value) ? (acc->sum - sum) + value
+                                              : (value - sum) + acc->sum;
+  acc->sum = sum;
+}
+
+static inline Compensated combine(Compensated a, Compensated b) {
+  neumaier_add(&a, b.sum);
+  a.error += b.error;
+  return a;
+}
+
+static Compensated reduce_block(Output *output, size_t begin, size_t end,
+                                Distribution *distribution) {
+  Compensated lanes[REDUCE_LANES] = {};
+
+  size_t i = begin;
+  for (; i + REDUCE_LANES <= end; i += REDUCE_LANES) {
+    for (int lane = 0; lane < REDUCE_LANES; ++lane) {
+      f64 *pair = output->pairs[i + lane];
+      f64 distance =
+          ReferenceHaversine(pair[0], pair[1], pair[2], pair[3], 6372.8);
+      neumaier_add(&lanes[lane], distance);
+      if (distribution) {
+        record_distance(distribution, distance);
+      }
+    }
+  }
+  for (int lane = 0; i < end; ++i, ++lane) {
+    f64 *pair = output->pairs[i];
+    f64 distance =
+        ReferenceHaversine(pair[0], pair[1], pair[2], pair[3], 6372.8);
+    neumaier_add(&lanes[lane], distance);
+    if (distribution) {
+      record_distance(distribution, distance);
+    }
+  }
+
+  return combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+}
+
+// Pairwise over block partials, always splitting at count / 2.
+static Compensated reduce_tree(Compensated *partials, size_t count) {
+  if (count == 1) {
+    return partials[0];
+  }
+  size_t half = count / 2;
+  return combine(reduce_tree(partials, half),
+                 reduce_tree(partials + half, count - half));
+}
+
+static void reduce_blocks(Output *output, Compensated *partials,
+                          size_t block_count, u32 first, u32 stride,
+                          Distribution *distribution) {
+  for (size_t block = first; block < block_count; block += stride) {
+    size_t begin = block * REDUCE_BLOCK;
+    size_t end = begin + REDUCE_BLOCK;
+    if (end > output->num_pairs) {
+      end = output->num_pairs;
+    }
+    partials[block] = reduce_block(output, begin, end, distribution);
+  }
+}
+
+// distribution, when given, is merged into rather than overwritten.
+static f64 parallel_average(Output *output, u32 thread_count,
+                            Distribution *distribution = nullptr) {
+  size_t count = output->num_pairs;
+  if (count == 0) {
+    return 0.0;
+  }
+
+  size_t block_count = (count + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+  if (thread_count > block_count) {
+    thread_count = (u32)block_count;
+  }
+
+  Compensated *partials = new Compensated[block_count];
+  Distribution *locals =
+      distribution ? new Distribution[thread_count]() : nullptr;
+  std::thread *workers = new std::thread[thread_count - 1];
+  for (u32 t = 1; t < thread_count; ++t) {
+    workers[t - 1] =
+        std::thread(reduce_blocks, output, partials, block_count, t,
+                    thread_count, locals ? &locals[t] : nullptr);
+  }
+  reduce_blocks(output, partials, block_count, 0, thread_count, locals);
+  for (u32 t = 1; t < thread_count; ++t) {
+    workers[t - 1].join();
+  }
+  if (locals) {
+    for (u32 t = 0; t < thread_count; ++t) {
+      merge_distribution(distribution, &locals[t]);
+    }
+    delete[] locals;
+  }
+
+  Compensated total = reduce_tree(partials, block_count);
+  delete[] workers;
+  delete[] partials;
+  return (total.sum + total.error) / (f64)count;
+}
@@ -0,0 +1,112 @@
+#include "../timing/repetition_tester.cc"
+#include <cstring>
+#include <stdlib.h>
+
+#include "buffer_alloc.cpp"
+
+// Compares buffer placements and page sizes from buffer_alloc.cpp: for each
+// configuration, how fast the buffer can be faulted in and then streamed by
+// `threads` readers, each reading every threads-th stripe like the reduction.
+
+#define STRIPE_SIZE (4096 * 32)
+
+struct BufferConfig {
+  Placement placement;
+  int node;
+  PageMode pages;
+};
+
+static void sum_stripes(u64 *base, size_t count, u32 first, u32 stride,
+                        u64 *result) {
+  size_t stripe = STRIPE_SIZE / sizeof(u64);
+  u64 sum = 0;
+  for (size_t start = first * stripe; start < count; start += stride * stripe) {
+    size_t end = start + stripe < count ? start + stripe : count;
+    for (size_t i = start; i < end; ++i) {
+      sum += base[i];
+    }
+  }
+  *result = sum;
+}
+
+static u64 read_buffer(u64 *base, size_t count, u32 thread_count) {
+  u64 *sums = new u64[thread_count];
+  std::thread *workers = new std::thread[thread_count];
+  for (u32 t = 0; t < thread_count; ++t) {
+    workers[t] =
+        std::thread(sum_stripes, base, count, t, thread_count, &sums[t]);
+  }
+  u64 total = 0;
+  for (u32 t = 0; t < thread_count; ++t) {
+    workers[t].join();
+    total += sums[t];
+  }
+  delete[] workers;
+  delete[] sums;
+  return total;
+}
+
+static f64 gigabytes_per_second(RepetitionTester *tester, size_t size) {
+  f64 seconds = (f64)tester->min_time / (f64)get_cpu_timer_frequency();
+  return (f64)size / (1024. * 1024. * 1024.) / seconds;
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 3) {
+    printf("Usage: %s [size_mb] [num_repetitions] [threads]\n", argv[0]);
+    return 1;
+  }
+
+  size_t size = (size_t)atol(argv[1]) * 1024 * 1024;
+  u32 num_repetitions = atoi(argv[2]);
+  u32 thread_count = argc > 3 ? atoi(argv[3]) : 1;
+  if (thread_count == 0) {
+    thread_count = 1;
+  }
+
+  BufferConfig configs[] = {
+      {Placement::FIRST_TOUCH, 0, PageMode::NORMAL},
+      {Placement::FIRST_TOUCH, 0, PageMode::TRANSPARENT},
+      {Placement::FIRST_TOUCH, 0, PageMode::EXPLICIT},
+      {Placement::NODE, 0, PageMode::NORMAL},
+      {Placement::INTERLEAVE, 0, PageMode::NORMAL},
+      {Placement::INTERLEAVE, 0, PageMode::TRANSPARENT},
+  };
+
+  for (BufferConfig &config : configs) {
+    BufferOptions options = {config.placement, config.node, config.pages,
+                             thread_count, STRIPE_SIZE};
+
+    static RepetitionTester fault_tester;
+    static RepetitionTester read_tester;
+    init_tester(&fault_tester, num_repetitions);
+    init_tester(&read_tester, num_repetitions);
+
+    u64 checksum = 0;
+    PageMode pages = config.pages;
+    while (is_testing(&fault_tester)) {
+      begin_time(&fault_tester);
+      u64 *buffer = (u64 *)alloc_buffer(size, &options);
+      end_time(&fault_tester);
+      add_bytes_processed(&fault_tester, size);
+      pages = buffer_page_mode(buffer);
+
+      begin_time(&read_tester);
+      checksum += read_buffer(buffer, size / sizeof(u64), thread_count);
+      end_time(&read_tester);
+      add_bytes_processed(&read_tester, size);
+
+      free_buffer(buffer);
+    }
+
+    // A hugetlb row that fell back to 4k pages is labelled as such.
+    printf("%s %s%s, %u threads: prefault %.2fGbps, read %.2fGbps "
+           "(checksum %llu)\n",
+           placement_name(config.placement), page_mode_name(pages),
+           pages != config.pages ? " (hugetlb unavailable)" : "",
+           thread_count, gigabytes_per_second(&fault_tester, size),
+           gigabytes_per_second(&read_tester, size),
+           (unsigned long long)checksum);
+  }
+}
@@ -1,47 +1,364 @@
 
 #include "../timing/repetition_tester.cc"
+#include "../timing/results.cc"
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-int main(int argc, char **argv) {
+// Read throughput of one file with the page cache in a known state:
+//   cold    the file is evicted (posix_fadvise DONTNEED, checked with
+//           mincore) before every read
+//   warm    the file is read once up front, so every read is a cache copy
+//   direct  O_DIRECT (F_NOCACHE on macOS) reads that bypass the cache
+// Reads go into a prefaulted buffer, so only warm mode's extra "fresh buffer"
+// run pays for page faults. From these the summary separates device
+// throughput (direct), page-cache copy (warm) and fault cost (the difference
+// between the two warm runs).
+//
+// Usage: test_read_speed num_repetitions [-mode cold|warm|direct|all]
+//                        [-file path | -size mb [-dir path]]
+//                        [-results file.jsonl|file.csv]
+//
+// -size writes a temporary file of that many MB in -dir (default "."),
+// which is removed afterwards. /tmp is often tmpfs, which has neither a
+// device behind it nor O_DIRECT, hence the default.
 
-  if (argc != 2) {
-    printf("Usage: %s [num_repetitions]\n", argv[0]);
-    return 1;
+#define READ_CHUNK_SIZE (16ull * 1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+
+enum class CacheMode {
+  COLD,
+  WARM,
+  DIRECT,
+};
+
+struct ReadTest {
+  const char *name;
+  CacheMode mode;
+  bool fresh_buffer; // map a new buffer per read, so the read faults it in
+  bool ran;
+  u64 faults; // minor faults over all repetitions
+  RepetitionTester tester;
+};
+
+static bool parse_cache_modes(const char *text, bool *modes) {
+  bool all = strcmp(text, "all") == 0;
+  modes[(int)CacheMode::COLD] = all || strcmp(text, "cold") == 0;
+  modes[(int)CacheMode::WARM] = all || strcmp(text, "warm") == 0;
+  modes[(int)CacheMode::DIRECT] = all || strcmp(text, "direct") == 0;
+  return modes[0] || modes[1] || modes[2];
+}
+
+static char *map_read_buffer(size_t size) {
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %zu bytes\n", size);
+    exit(1);
   }
+  return (char *)base;
+}
 
-  size_t num_repetitions = atoi(argv[1]);
+static u64 minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
 
-  static RepetitionTester tester;
-  init_tester(&tester, num_repetitions);
+// Writes size bytes of non-zero data to a new file in dir and flushes it, so
+// the first cold read can evict it (dirty pages can't be dropped).
+static char *generate_file(const char *dir, size_t size) {
+  size_t path_size = strlen(dir) + 32;
+  char *path = (char *)malloc(path_size);
+  snprintf(path, path_size, "%s/read_speed_XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "Can't create a file in %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
 
-  struct stat stat_res;
-  stat("haversine_inp.json", &stat_res);
+  char *chunk = map_read_buffer(READ_CHUNK_SIZE);
+  for (size_t i = 0; i < READ_CHUNK_SIZE; ++i) {
+    chunk[i] = (char)(i * 131 + 7);
+  }
+  size_t written = 0;
+  while (written < size) {
+    size_t want = size - written < READ_CHUNK_SIZE ? size - written
+                                                   : READ_CHUNK_SIZE;
+    ssize_t got = write(fd, chunk, want);
+    if (got <= 0) {
+      fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+      unlink(path);
+      exit(1);
+    }
+    written += got;
+  }
+  fsync(fd);
+  close(fd);
+  munmap(chunk, READ_CHUNK_SIZE);
+  return path;
+}
+
+static int open_for_mode(const char *path, CacheMode mode) {
+  if (mode != CacheMode::DIRECT) {
+    return open(path, O_RDONLY);
+  }
+#if defined(O_DIRECT)
+  return open(path, O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0 && fcntl(fd, F_NOCACHE, 1) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+// Pages of the file still in the page cache, or -1 if that can't be told.
+static long resident_pages(int fd, size_t size) {
+#if defined(__APPLE__)
+  typedef char ResidencyVector; // mincore's vector type differs by platform
+#else
+  typedef unsigned char ResidencyVector;
+#endif
+  void *base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t pages = (size + page_size - 1) / page_size;
+  ResidencyVector *vector = (ResidencyVector *)malloc(pages);
+  long resident = -1;
+  if (mincore(base, size, vector) == 0) {
+    resident = 0;
+    for (size_t i = 0; i < pages; ++i) {
+      resident += vector[i] & 1;
+    }
+  }
+  free(vector);
+  munmap(base, size);
+  return resident;
+}
+
+// Drops the file from the page cache. Success from posix_fadvise proves
+// nothing (tmpfs accepts and ignores it), so this checks with mincore that
+// at most 1% of the file is still resident.
+static bool evict_file(int fd, size_t size) {
+#if defined(POSIX_FADV_DONTNEED)
+  fdatasync(fd);
+  if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+    return false;
+  }
+  long resident = resident_pages(fd, size);
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return resident >= 0 &&
+         (size_t)resident * 100 <= (size + page_size - 1) / page_size;
+#else
+  return false;
+#endif
+}
+
+// Reads the whole file in READ_CHUNK_SIZE pieces. Chunks and the buffer are
+// block-aligned, which O_DIRECT needs; the last chunk comes back short.
+static size_t read_file(int fd, char *buffer, size_t size) {
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t got = pread(fd, buffer + offset, READ_CHUNK_SIZE, offset);
+    if (got <= 0) {
+      break;
+    }
+    offset += got;
+  }
+  return offset;
+}
+
+static bool run_read_test(ReadTest *test, const char *path, size_t size,
+                          char *buffer, size_t buffer_size,
+                          u32 num_repetitions) {
+  int fd = open_for_mode(path, test->mode);
+  if (fd < 0) {
+    printf("%-26s skipped: can't open %s (%s)\n", test->name, path,
+           strerror(errno));
+    return false;
+  }
+  if (test->mode == CacheMode::WARM) {
+    read_file(fd, buffer, size);
+  }
 
-  while (is_testing(&tester)) {
+  RepetitionTester *tester = &test->tester;
+  init_tester(tester, num_repetitions);
+  tester->quiet = true;
+  test->faults = 0;
+  while (is_testing(tester)) {
+    if (test->mode == CacheMode::COLD && !evict_file(fd, size)) {
+      printf("%-26s skipped: can't evict %s from the page cache\n", test->name,
+             path);
+      close(fd);
+      return false;
+    }
+    char *target = test->fresh_buffer ? map_read_buffer(buffer_size) : buffer;
 
-    FILE *file = fopen("haversine_inp.json", "rb");
+    u64 start_faults = minor_faults();
+    begin_time(tester);
+    size_t got = read_file(fd, target, size);
+    end_time(tester);
+    test->faults += minor_faults() - start_faults;
 
-    if (file) {
-      uint8_t *buffer = (uint8_t *)malloc(stat_res.st_size);
-      begin_time(&tester);
+    if (test->fresh_buffer) {
+      munmap(target, buffer_size);
+    }
+    if (got != size) {
+      printf("%-26s failed: read %zu of %zu bytes (%s)\n", test->name, got,
+             size, strerror(errno));
+      close(fd);
+      return false;
+    }
+    add_bytes_processed(tester, size);
+  }
+  close(fd);
+  return true;
+}
 
-      fread(buffer, stat_res.st_size, 1, file);
+static f64 seconds(u64 ticks) {
+  return (f64)ticks / (f64)get_cpu_timer_frequency();
+}
 
-      end_time(&tester);
+static f64 gigabytes_per_second(size_t size, u64 ticks) {
+  return (f64)size / (1024. * 1024. * 1024.) / seconds(ticks);
+}
 
-      free(buffer);
-      count_page_faults(&tester);
-      add_bytes_processed(&tester, stat_res.st_size);
+int main(int argc, char **argv) {
+  u32 num_repetitions = argc > 1 ? atoi(argv[1]) : 0;
+  const char *path = "haversine_inp.json";
+  const char *dir = ".";
+  const char *results_path = nullptr;
+  size_t generate_size = 0;
+  bool modes[3] = {true, true, true};
+  bool valid = num_repetitions > 0;
+  for (int i = 2; valid && i < argc; ++i) {
+    if (strcmp(argv[i], "-mode") == 0 && i + 1 < argc) {
+      valid = parse_cache_modes(argv[++i], modes);
+    } else if (strcmp(argv[i], "-file") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+      generate_size = (size_t)atol(argv[++i]) * 1024 * 1024;
+      valid = generate_size > 0;
+    } else if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (strcmp(argv[i], "-results") == 0 && i + 1 < argc) {
+      results_path = argv[++i];
     } else {
-      printf("WE DID A BAD THING :( %s\n", strerror(errno));
+      valid = false;
+    }
+  }
+  if (!valid) {
+    printf("Usage: %s num_repetitions [-mode cold|warm|direct|all] "
+           "[-file path | -size mb [-dir path]] "
+           "[-results file.jsonl|file.csv]\n",
+           argv[0]);
+    return 1;
+  }
+
+  char *generated = nullptr;
+  if (generate_size) {
+    generated = generate_file(dir, generate_size);
+    path = generated;
+  }
+
+  struct stat stat_res;
+  if (stat(path, &stat_res) != 0 || stat_res.st_size == 0) {
+    printf("Can't read %s: %s\n", path, strerror(errno));
+    if (generated) {
+      unlink(generated);
+    }
+    return 1;
+  }
+  size_t size = stat_res.st_size;
+  // Room for a whole trailing chunk, so direct reads never run off the end.
+  size_t buffer_size = (size + READ_CHUNK_SIZE + DIRECT_ALIGNMENT - 1) &
+                       ~(size_t)(DIRECT_ALIGNMENT - 1);
+  char *buffer = map_read_buffer(buffer_size);
+  memset(buffer, 0, buffer_size);
+
+  printf("%s: %.2fMB, %u repetitions\n\n", path, size / 1024. / 1024.,
+         num_repetitions);
+
+  static ReadTest tests[] = {
+      {"cold", CacheMode::COLD, false, false, 0, {}},
+      {"warm", CacheMode::WARM, false, false, 0, {}},
+      {"warm, fresh buffer", CacheMode::WARM, true, false, 0, {}},
+      {"direct", CacheMode::DIRECT, false, false, 0, {}},
+  };
+  printf("%-26s %10s %10s %10s %12s\n", "read", "min ms", "avg ms", "GB/s",
+         "faults/read");
+  for (ReadTest &test : tests) {
+    if (!modes[(int)test.mode]) {
+      continue;
+    }
+    test.ran = run_read_test(&test, path, size, buffer, buffer_size,
+                             num_repetitions);
+    if (test.ran) {
+      RepetitionTester *tester = &test.tester;
+      printf("%-26s %10.3f %10.3f %10.2f %12llu\n", test.name,
+             seconds(tester->min_time) * 1000.,
+             seconds(tester->avg_time) * 1000.,
+             gigabytes_per_second(size, tester->min_time),
+             (unsigned long long)(test.faults / num_repetitions));
     }
+  }
+
+  ReadTest &cold = tests[0], &warm = tests[1], &fresh = tests[2],
+           &direct = tests[3];
+  printf("\n");
+  if (direct.ran) {
+    printf("Device throughput:  %.2fGB/s (direct)\n",
+           gigabytes_per_second(size, direct.tester.min_time));
+  }
+  if (cold.ran && warm.ran && cold.tester.min_time > warm.tester.min_time) {
+    printf("Cold miss cost:     %.2fGB/s (cold minus warm: device plus "
+           "cache insertion)\n",
+           gigabytes_per_second(size, cold.tester.min_time -
+                                          warm.tester.min_time));
+  }
+  if (warm.ran) {
+    printf("Page-cache copy:    %.2fGB/s (warm)\n",
+           gigabytes_per_second(size, warm.tester.min_time));
+  }
+  if (warm.ran && fresh.ran) {
+    u64 faults = fresh.faults / num_repetitions;
+    f64 extra = fresh.tester.min_time > warm.tester.min_time
+                    ? seconds(fresh.tester.min_time - warm.tester.min_time)
+                    : 0;
+    printf("Fault cost:         %.3fms per read, %llu faults, %.0fns each\n",
+           extra * 1000., (unsigned long long)faults,
+           faults ? extra * 1e9 / faults : 0.);
+  }
 
-    fclose(file);
+  if (results_path) {
+    ResultSink sink;
+    if (open_results(&sink, results_path, "test_read_speed")) {
+      for (ReadTest &test : tests) {
+        if (test.ran) {
+          write_result(&sink, test.name, "ticks", size, test.tester.samples,
+                       recorded_samples(&test.tester));
+        }
+      }
+      close_results(&sink);
+    }
   }
 
-  print_stats(&tester);
+  munmap(buffer, buffer_size);
+  if (generated) {
+    unlink(generated);
+    free(generated);
+  }
 }
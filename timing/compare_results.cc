@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+// Diffs two results files written through results.cc (JSON lines or CSV)
+// and flags regressions. Series are matched on tool, name and unit. A series
+// regressed when its min got worse by more than the threshold and a
+// Mann-Whitney U test on the samples says the shift is significant. Series
+// with fewer than 3 samples on either side only get the threshold check and
+// are marked as unconfirmed.
+//
+// Usage: compare_results baseline candidate [-threshold pct] [-alpha p]
+// Exits with 1 when anything regressed.
+
+typedef double f64;
+typedef uint64_t u64;
+
+struct Series {
+  std::vector<f64> samples; // seconds for tick series, raw otherwise
+  u64 bytes;
+  std::string git;
+  std::string host;
+  std::string cpu;
+};
+
+typedef std::map<std::string, Series> ResultSet;
+
+// Value of "key": in one of our JSON lines, as text up to the next '"' for
+// strings or the raw number/array start otherwise.
+static const char *json_field(const char *line, const char *key) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  const char *at = strstr(line, pattern);
+  return at ? at + strlen(pattern) : nullptr;
+}
+
+static std::string json_string(const char *line, const char *key) {
+  const char *at = json_field(line, key);
+  if (!at || *at != '"') {
+    return "";
+  }
+  const char *end = strchr(at + 1, '"');
+  return end ? std::string(at + 1, end - at - 1) : "";
+}
+
+static u64 json_u64(const char *line, const char *key) {
+  const char *at = json_field(line, key);
+  return at ? strtoull(at, nullptr, 10) : 0;
+}
+
+static f64 sample_scale(const std::string &unit, u64 timer_hz) {
+  return unit == "ticks" && timer_hz ? 1.0 / (f64)timer_hz : 1.0;
+}
+
+static void add_json_line(ResultSet *set, const char *line) {
+  std::string unit = json_string(line, "unit");
+  std::string key = json_string(line, "tool") + "/" +
+                    json_string(line, "name") + " [" + unit + "]";
+  Series &series = (*set)[key];
+  series.bytes = json_u64(line, "bytes");
+  series.git = json_string(line, "git");
+  series.host = json_string(line, "host");
+  series.cpu = json_string(line, "cpu");
+
+  f64 scale = sample_scale(unit, json_u64(line, "timer_hz"));
+  const char *at = json_field(line, "samples");
+  if (!at || *at != '[') {
+    return;
+  }
+  ++at;
+  while (*at && *at != ']') {
+    char *end;
+    u64 sample = strtoull(at, &end, 10);
+    if (end == at) {
+      break;
+    }
+    series.samples.push_back(sample * scale);
+    at = end;
+    while (*at == ',' || *at == ' ') {
+      ++at;
+    }
+  }
+}
+
+// tool,name,unit,git,host,cpu,timer_hz,bytes,sample
+static void add_csv_line(ResultSet *set, char *line) {
+  line[strcspn(line, "\n")] = '\0';
+  char *fields[9];
+  int count = 0;
+  // Fields may be empty (e.g. no git SHA), so no strtok.
+  for (char *field = line; field && count < 9; ++count) {
+    fields[count] = field;
+    field = strchr(field, ',');
+    if (field) {
+      *field++ = '\0';
+    }
+  }
+  if (count != 9) {
+    return;
+  }
+
+  std::string unit = fields[2];
+  std::string key =
+      std::string(fields[0]) + "/" + fields[1] + " [" + unit + "]";
+  Series &series = (*set)[key];
+  series.git = fields[3];
+  series.host = fields[4];
+  series.cpu = fields[5];
+  series.bytes = strtoull(fields[7], nullptr, 10);
+  f64 scale = sample_scale(unit, strtoull(fields[6], nullptr, 10));
+  series.samples.push_back(strtoull(fields[8], nullptr, 10) * scale);
+}
+
+static bool load_results(const char *path, ResultSet *set) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Can't open %s\n", path);
+    return false;
+  }
+
+  static char line[1 << 20];
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '{') {
+      add_json_line(set, line);
+    } else if (strncmp(line, "tool,", 5) != 0) {
+      add_csv_line(set, line);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+// Two-sided p-value of the Mann-Whitney U test, normal approximation with
+// average ranks for ties.
+static f64 mann_whitney_p(const std::vector<f64> &a,
+                          const std::vector<f64> &b) {
+  std::vector<std::pair<f64, int>> all;
+  for (f64 value : a) {
+    all.push_back({value, 0});
+  }
+  for (f64 value : b) {
+    all.push_back({value, 1});
+  }
+  std::sort(all.begin(), all.end());
+
+  f64 rank_sum_a = 0;
+  for (size_t i = 0; i < all.size();) {
+    size_t j = i;
+    while (j < all.size() && all[j].first == all[i].first) {
+      j++;
+    }
+    f64 rank = (i + 1 + j) / 2.0; // average of ranks i+1 .. j
+    for (size_t k = i; k < j; ++k) {
+      rank_sum_a += all[k].second == 0 ? rank : 0;
+    }
+    i = j;
+  }
+
+  f64 n1 = a.size(), n2 = b.size();
+  f64 u = rank_sum_a - n1 * (n1 + 1) / 2;
+  f64 mean = n1 * n2 / 2;
+  f64 deviation = sqrt(n1 * n2 * (n1 + n2 + 1) / 12);
+  if (deviation == 0) {
+    return 1.0;
+  }
+  return erfc(fabs(u - mean) / deviation / sqrt(2.0));
+}
+
+static f64 min_of(const std::vector<f64> &values) {
+  return *std::min_element(values.begin(), values.end());
+}
+
+static f64 median_of(std::vector<f64> values) {
+  std::sort(values.begin(), values.end());
+  size_t half = values.size() / 2;
+  return values.size() % 2 ? values[half]
+                           : (values[half - 1] + values[half]) / 2;
+}
+
+static void describe(const char *label, ResultSet &set) {
+  if (!set.empty()) {
+    Series &any = set.begin()->second;
+    printf("%s: git %s, host %s, cpu %s\n", label, any.git.c_str(),
+           any.host.c_str(), any.cpu.c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  f64 threshold = 2.0;
+  f64 alpha = 0.05;
+  const char *paths[2] = {};
+  int path_count = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-alpha") == 0 && i + 1 < argc) {
+      alpha = atof(argv[++i]);
+    } else if (path_count < 2) {
+      paths[path_count++] = argv[i];
+    }
+  }
+
+  if (path_count != 2) {
+    printf("Usage: %s baseline candidate [-threshold pct] [-alpha p]\n",
+           argv[0]);
+    return 2;
+  }
+
+  ResultSet baseline, candidate;
+  if (!load_results(paths[0], &baseline) ||
+      !load_results(paths[1], &candidate)) {
+    return 2;
+  }
+  describe("baseline ", baseline);
+  describe("candidate", candidate);
+
+  int regressions = 0;
+  for (auto &entry : baseline) {
+    auto found = candidate.find(entry.first);
+    if (found == candidate.end() || entry.second.samples.empty() ||
+        found->second.samples.empty()) {
+      continue;
+    }
+    Series &a = entry.second;
+    Series &b = found->second;
+
+    f64 min_a = min_of(a.samples), min_b = min_of(b.samples);
+    f64 change = min_a > 0 ? 100.0 * (min_b - min_a) / min_a : 0.0;
+    bool enough = a.samples.size() >= 3 && b.samples.size() >= 3;
+    f64 p = enough ? mann_whitney_p(a.samples, b.samples) : 1.0;
+    bool slower =
+        change > threshold && median_of(b.samples) > median_of(a.samples);
+
+    const char *verdict = "";
+    if (slower && enough && p < alpha) {
+      verdict = "  REGRESSION";
+      regressions++;
+    } else if (change > threshold && !enough) {
+      verdict = "  slower (unconfirmed, <3 samples)";
+    } else if (change < -threshold && enough && p < alpha) {
+      verdict = "  improved";
+    }
+
+    printf("%s: min %.6g -> %.6g (%+.2f%%), n %zu/%zu", entry.first.c_str(),
+           min_a, min_b, change, a.samples.size(), b.samples.size());
+    if (a.bytes && min_a > 0 && min_b > 0) {
+      f64 gigabyte = 1024. * 1024. * 1024.;
+      printf(", %.2f -> %.2f GB/s", a.bytes / gigabyte / min_a,
+             b.bytes / gigabyte / min_b);
+    }
+    if (enough) {
+      printf(", p=%.3g", p);
+    }
+    printf("%s\n", verdict);
+  }
+
+  printf("%d regression%s\n", regressions, regressions == 1 ? "" : "s");
+  return regressions ? 1 : 0;
+}
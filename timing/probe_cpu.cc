@@ -0,0 +1,195 @@
+#include <sys/mman.h>
+
+#include "repetition_tester.cc"
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "probe_kernels.S has kernels for x86-64 and AArch64 only"
+#endif
+
+// Microarchitecture probes to explain parse-loop costs: branch prediction on
+// different patterns, throughput of a few instruction classes, loop placement
+// relative to cache lines, and loads/stores per cycle. The kernels are in
+// probe_kernels.S; each is timed with the repetition tester and reported in
+// core cycles per loop iteration.
+//
+// The CPU timer doesn't count core cycles (TSC, CNTVCT), so cycles are
+// calibrated from add_latency: 8 dependent adds are 8 cycles per iteration
+// on any core with single-cycle add latency.
+
+typedef unsigned char u8;
+typedef void Kernel(u64 count, const u8 *data);
+
+extern "C" {
+Kernel branch_pattern, add_throughput, add_latency, mul_throughput,
+    nop_throughput, load_x4, load_simd_x4, store_x4, load_store_x2,
+    loop_offset_0, loop_offset_16, loop_offset_32, loop_offset_48,
+    loop_offset_60;
+}
+
+#define ITERATIONS (1u << 22)
+#define DATA_SIZE 4096
+
+static u64 min_ticks(Kernel *kernel, const u8 *data, u32 repetitions) {
+  static RepetitionTester tester;
+  init_tester(&tester, repetitions);
+  tester.quiet = true;
+  while (is_testing(&tester)) {
+    clobber_memory();
+    begin_time(&tester);
+    kernel(ITERATIONS, data);
+    end_time(&tester);
+  }
+  return tester.min_time;
+}
+
+static f64 cycles_per_tick;
+
+static f64 cycles_per_iteration(Kernel *kernel, const u8 *data,
+                                u32 repetitions) {
+  return (f64)min_ticks(kernel, data, repetitions) * cycles_per_tick /
+         ITERATIONS;
+}
+
+struct ThroughputProbe {
+  const char *name;
+  Kernel *kernel;
+  u32 ops; // per iteration, not counting the loop branch
+};
+
+static void probe_throughput(const u8 *data, u32 repetitions) {
+  ThroughputProbe probes[] = {
+      {"add (7 independent)", add_throughput, 7},
+      {"add (1 chain of 8)", add_latency, 8},
+      {"mul (6 independent)", mul_throughput, 6},
+      {"nop x8", nop_throughput, 8},
+      {"load 8B x4", load_x4, 4},
+      {"load 16B x4", load_simd_x4, 4},
+      {"store 8B x4", store_x4, 4},
+      {"load x2 + store x2", load_store_x2, 4},
+  };
+  printf("\n%-24s %12s %10s\n", "throughput", "cycles/iter", "ops/cycle");
+  for (ThroughputProbe &probe : probes) {
+    f64 cycles = cycles_per_iteration(probe.kernel, data, repetitions);
+    printf("%-24s %12.2f %10.2f\n", probe.name, cycles, probe.ops / cycles);
+  }
+}
+
+// xorshift64, so the random patterns are the same on every run.
+static u64 next_random(u64 *state) {
+  u64 x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+enum class Pattern {
+  NEVER,
+  ALWAYS,
+  ALTERNATE,
+  EVERY_4TH,
+  RANDOM_PERIOD_32,
+  RANDOM_PERIOD_4096,
+  RANDOM_90_TAKEN,
+  RANDOM,
+};
+
+static const char *pattern_names[] = {
+    "never taken",         "always taken",
+    "alternating",         "every 4th",
+    "random, repeats /32", "random, repeats /4096",
+    "random, 90% taken",   "random",
+};
+
+static void fill_pattern(u8 *pattern, Pattern kind) {
+  u64 state = 0x9E3779B97F4A7C15ull;
+  for (u32 i = 0; i < ITERATIONS; ++i) {
+    u8 taken = 0;
+    switch (kind) {
+    case Pattern::NEVER:
+      break;
+    case Pattern::ALWAYS:
+      taken = 1;
+      break;
+    case Pattern::ALTERNATE:
+      taken = i & 1;
+      break;
+    case Pattern::EVERY_4TH:
+      taken = (i & 3) == 0;
+      break;
+    case Pattern::RANDOM_PERIOD_32:
+      taken = i < 32 ? next_random(&state) & 1 : pattern[i - 32];
+      break;
+    case Pattern::RANDOM_PERIOD_4096:
+      taken = i < 4096 ? next_random(&state) & 1 : pattern[i - 4096];
+      break;
+    case Pattern::RANDOM_90_TAKEN:
+      taken = next_random(&state) % 10 != 0;
+      break;
+    case Pattern::RANDOM:
+      taken = next_random(&state) & 1;
+      break;
+    }
+    pattern[i] = taken;
+  }
+}
+
+// The "random" row against "never taken" gives the misprediction penalty:
+// half of its branches miss.
+static void probe_branches(u32 repetitions) {
+  u8 *pattern = (u8 *)mmap(nullptr, ITERATIONS, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  printf("\n%-24s %12s\n", "branch pattern", "cycles/iter");
+  f64 baseline = 0, random = 0;
+  for (u32 kind = 0; kind <= (u32)Pattern::RANDOM; ++kind) {
+    fill_pattern(pattern, (Pattern)kind);
+    f64 cycles = cycles_per_iteration(branch_pattern, pattern, repetitions);
+    printf("%-24s %12.2f\n", pattern_names[kind], cycles);
+    if ((Pattern)kind == Pattern::NEVER) {
+      baseline = cycles;
+    } else if ((Pattern)kind == Pattern::RANDOM) {
+      random = cycles;
+    }
+  }
+  printf("Estimated misprediction penalty: %.1f cycles\n",
+         (random - baseline) * 2);
+  munmap(pattern, ITERATIONS);
+}
+
+static void probe_alignment(const u8 *data, u32 repetitions) {
+  struct {
+    u32 offset;
+    Kernel *kernel;
+  } loops[] = {
+      {0, loop_offset_0},   {16, loop_offset_16}, {32, loop_offset_32},
+      {48, loop_offset_48}, {60, loop_offset_60},
+  };
+  printf("\n%-24s %12s\n", "loop start in line", "cycles/iter");
+  for (auto &loop : loops) {
+    char name[32];
+    snprintf(name, sizeof(name), "+%u bytes", loop.offset);
+    printf("%-24s %12.2f\n", name,
+           cycles_per_iteration(loop.kernel, data, repetitions));
+  }
+}
+
+int main(int argc, char **argv) {
+  u32 repetitions = argc > 1 ? atoi(argv[1]) : 20;
+  if (repetitions == 0) {
+    printf("Usage: %s [num_repetitions]\n", argv[0]);
+    return 1;
+  }
+
+  alignas(64) static u8 data[DATA_SIZE];
+
+  cycles_per_tick = 1.0;
+  f64 ticks = cycles_per_iteration(add_latency, data, repetitions);
+  cycles_per_tick = 8.0 / ticks;
+  printf("CPU timer: %llu Hz, core clock ~%.2f GHz (%.3f cycles/tick)\n",
+         (unsigned long long)get_cpu_timer_frequency(),
+         cycles_per_tick * get_cpu_timer_frequency() / 1e9, cycles_per_tick);
+
+  probe_throughput(data, repetitions);
+  probe_branches(repetitions);
+  probe_alignment(data, repetitions);
+}
@@ -5,18 +5,22 @@
 #include <sys/mman.h>
 #include <sys/resource.h>
 
-typedef unsigned long long u64;
+#include "time.cc"
+#include "results.cc"
+
 typedef unsigned char u8;
 
 int main(int argc, char **argv) {
   u64 page_size = 4096 * 4;
 
-  if (argc != 2) {
-    printf("Usage: %s [num_pages]\n", argv[0]);
+  if (argc != 2 && !(argc == 4 && strcmp(argv[2], "-results") == 0)) {
+    printf("Usage: %s [num_pages] [-results file.jsonl|file.csv]\n", argv[0]);
     return 1;
   }
 
   u64 pages = atol(argv[1]);
+  u64 *faults = new u64[pages]();
+  bool *mapped = new bool[pages]();
 
   printf("Page Count, Touch Count, Fault Count, Fault Extra\n");
 
@@ -27,7 +31,7 @@ int main(int argc, char **argv) {
     u8 *bytes = (u8 *)mmap(0, cur_size, PROT_WRITE | PROT_READ,
                            MAP_ANON | MAP_PRIVATE, -1, 0);
 
-    if (bytes) {
+    if (bytes != MAP_FAILED) {
       getrusage(RUSAGE_SELF, &rusage_res);
       u64 start_fault = rusage_res.ru_minflt;
 
@@ -38,10 +42,32 @@ int main(int argc, char **argv) {
       getrusage(RUSAGE_SELF, &rusage_res);
       u64 end_fault = rusage_res.ru_minflt;
 
-      printf("%llu, %llu, %llu, %lld\n", pages, i, end_fault - start_fault,
-             (end_fault - start_fault - i));
+      u64 fault_count = end_fault - start_fault;
+      printf("%llu, %llu, %llu, %lld\n", (unsigned long long)pages,
+             (unsigned long long)i, (unsigned long long)fault_count,
+             (long long)(fault_count - i));
+      faults[i] = fault_count;
+      mapped[i] = true;
 
       munmap(bytes, cur_size);
     }
   }
+
+  if (argc == 4) {
+    ResultSink sink;
+    if (open_results(&sink, argv[3], "probe_os_faults")) {
+      // One series per mapping size, so runs compare like with like.
+      for (u64 i = 0; i < pages; ++i) {
+        if (mapped[i]) {
+          char name[64];
+          snprintf(name, sizeof(name), "touch faults n=%llu",
+                   (unsigned long long)i);
+          write_result(&sink, name, "faults", i * page_size, &faults[i], 1);
+        }
+      }
+      close_results(&sink);
+    }
+  }
+  delete[] mapped;
+  delete[] faults;
 }
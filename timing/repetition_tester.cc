@@ -1,10 +1,13 @@
 
 #include <cstdint>
+#include <cstring>
 #include <stdint.h>
 #include <sys/resource.h>
 
 #include "time.cc"
 
+#define MAX_RECORDED_SAMPLES 4096
+
 struct RepetitionTester {
   uint32_t num_repetitions;
   uint32_t cur_repetitions;
@@ -17,16 +20,24 @@ struct RepetitionTester {
   uint64_t page_faults;
 
   uint64_t current_start_time;
+
+  // Skips the per-run line, for tools that run many short repetitions.
+  bool quiet;
+
+  // Per-repetition times, for results files (first MAX_RECORDED_SAMPLES).
+  uint64_t samples[MAX_RECORDED_SAMPLES];
 };
 
 void init_tester(RepetitionTester *tester, u32 num_repetitions) {
   tester->cur_repetitions = 0;
   tester->min_time = INT64_MAX;
   tester->max_time = 0;
+  tester->avg_time = 0;
   tester->current_start_time = read_cpu_timer();
   tester->num_repetitions = num_repetitions;
   tester->bytes_processed = 0;
   tester->page_faults = 0;
+  tester->quiet = false;
 }
 
 void begin_time(RepetitionTester *tester) {
@@ -35,8 +46,10 @@ void begin_time(RepetitionTester *tester) {
 
 void end_time(RepetitionTester *tester) {
 
-  printf("Completed RUN %d\n", tester->cur_repetitions);
   u64 end_time = read_cpu_timer();
+  if (!tester->quiet) {
+    printf("Completed RUN %d\n", tester->cur_repetitions);
+  }
   u64 time_taken = end_time - tester->current_start_time;
 
   if (time_taken < tester->min_time) {
@@ -47,6 +60,10 @@ void end_time(RepetitionTester *tester) {
     tester->max_time = time_taken;
   }
 
+  if (tester->cur_repetitions < MAX_RECORDED_SAMPLES) {
+    tester->samples[tester->cur_repetitions] = time_taken;
+  }
+
   tester->cur_repetitions += 1;
   tester->avg_time = (tester->avg_time * ((f64)(tester->cur_repetitions - 1) /
                                           tester->cur_repetitions)) +
@@ -77,3 +94,187 @@ void count_page_faults(RepetitionTester *tester) {
 void add_bytes_processed(RepetitionTester *tester, u64 byte_count) {
   tester->bytes_processed += byte_count;
 }
+
+u32 recorded_samples(RepetitionTester *tester) {
+  return tester->cur_repetitions < MAX_RECORDED_SAMPLES
+             ? tester->cur_repetitions
+             : MAX_RECORDED_SAMPLES;
+}
+
+// Compiler barriers for benchmark bodies. keep_value makes the compiler
+// materialize a result as if something read it; clobber_memory makes it
+// assume all memory was read and written, so stores can't be dropped and
+// loads can't be hoisted out of the timed region.
+template <typename T> static inline void keep_value(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+// Parameter sweeps: one candidate timed at every point of a range, giving a
+// throughput curve (e.g. against buffer size, chunk size or thread count)
+// instead of a single number.
+
+struct SweepRange {
+  const char *name;
+  u64 first;
+  u64 last;
+  u64 step;
+  bool multiply; // step is a factor rather than an increment
+  bool bytes;    // print values as sizes
+};
+
+struct SweepCandidate {
+  const char *name;
+  void *context;
+
+  // Untimed, once per point before its repetitions. Optional.
+  void (*prepare)(void *context, u64 parameter);
+
+  // One timed repetition; returns the bytes it processed.
+  u64 (*run)(void *context, u64 parameter);
+};
+
+struct SweepPoint {
+  u64 parameter;
+  u64 bytes; // per repetition
+  u64 min_time;
+  u64 avg_time;
+  u32 sample_count;
+  u64 samples[MAX_RECORDED_SAMPLES];
+};
+
+static u64 sweep_next(SweepRange *range, u64 value) {
+  return range->multiply ? value * range->step : value + range->step;
+}
+
+// A range has to move towards last: a non-zero increment, or a factor of at
+// least 2 from a non-zero start.
+static inline bool sweep_range_valid(SweepRange *range) {
+  if (range->first > range->last || range->step == 0) {
+    return false;
+  }
+  return !range->multiply || (range->first != 0 && range->step >= 2);
+}
+
+// 0 for an invalid range. Stops before a step would pass last, so values
+// near the top of u64 can't wrap around.
+static u32 sweep_point_count(SweepRange *range) {
+  if (!sweep_range_valid(range)) {
+    return 0;
+  }
+  u32 count = 1;
+  for (u64 value = range->first;; value = sweep_next(range, value)) {
+    bool more = range->multiply ? value <= range->last / range->step
+                                : range->step <= range->last - value;
+    if (!more) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Fills one point per range value; points must hold sweep_point_count().
+static inline u32 run_sweep(SweepCandidate *candidate, SweepRange *range,
+                            u32 repetitions, SweepPoint *points) {
+  static RepetitionTester tester;
+  u32 count = sweep_point_count(range);
+  u64 value = range->first;
+  for (u32 i = 0; i < count; ++i, value = sweep_next(range, value)) {
+    if (candidate->prepare) {
+      candidate->prepare(candidate->context, value);
+    }
+
+    init_tester(&tester, repetitions);
+    tester.quiet = true;
+    u64 bytes = 0;
+    while (is_testing(&tester)) {
+      clobber_memory();
+      begin_time(&tester);
+      bytes = candidate->run(candidate->context, value);
+      keep_value(bytes);
+      end_time(&tester);
+      clobber_memory();
+    }
+
+    SweepPoint *point = &points[i];
+    point->parameter = value;
+    point->bytes = bytes;
+    point->min_time = tester.min_time;
+    point->avg_time = tester.avg_time;
+    point->sample_count = recorded_samples(&tester);
+    memcpy(point->samples, tester.samples,
+           point->sample_count * sizeof(point->samples[0]));
+  }
+  return count;
+}
+
+static f64 sweep_gigabytes_per_second(SweepPoint *point) {
+  f64 seconds = (f64)point->min_time / (f64)get_cpu_timer_frequency();
+  return seconds > 0 ? (f64)point->bytes / (1024. * 1024. * 1024.) / seconds
+                     : 0.0;
+}
+
+static void format_sweep_value(SweepRange *range, u64 value, char *text,
+                               size_t size) {
+  if (range->bytes && value >= (1ull << 30) && value % (1ull << 30) == 0) {
+    snprintf(text, size, "%lluG", (unsigned long long)(value >> 30));
+  } else if (range->bytes && value >= (1 << 20) && value % (1 << 20) == 0) {
+    snprintf(text, size, "%lluM", (unsigned long long)(value >> 20));
+  } else if (range->bytes && value >= 1024 && value % 1024 == 0) {
+    snprintf(text, size, "%lluK", (unsigned long long)(value >> 10));
+  } else {
+    snprintf(text, size, "%llu", (unsigned long long)value);
+  }
+}
+
+#define SWEEP_BAR_WIDTH 40
+#define SWEEP_CLIFF_DROP 0.25
+
+// Throughput curve with a bar per point. Points more than SWEEP_CLIFF_DROP
+// below their predecessor are flagged; those are the cache and TLB edges.
+static inline void print_sweep(SweepCandidate *candidate, SweepRange *range,
+                               SweepPoint *points, u32 count) {
+  if (count == 0) {
+    return;
+  }
+  f64 best = 0;
+  u32 best_index = 0;
+  for (u32 i = 0; i < count; ++i) {
+    f64 rate = sweep_gigabytes_per_second(&points[i]);
+    if (rate > best) {
+      best = rate;
+      best_index = i;
+    }
+  }
+
+  printf("%s vs %s:\n", candidate->name, range->name);
+  printf("%12s %10s %10s\n", range->name, "GB/s", "avg GB/s");
+  f64 previous = 0;
+  for (u32 i = 0; i < count; ++i) {
+    SweepPoint *point = &points[i];
+    f64 rate = sweep_gigabytes_per_second(point);
+    f64 avg_seconds = (f64)point->avg_time / (f64)get_cpu_timer_frequency();
+    f64 avg_rate = avg_seconds > 0 ? (f64)point->bytes /
+                                         (1024. * 1024. * 1024.) / avg_seconds
+                                   : 0.0;
+
+    char value[32];
+    format_sweep_value(range, point->parameter, value, sizeof(value));
+    char bar[SWEEP_BAR_WIDTH + 1];
+    u32 width = best > 0 ? (u32)(rate / best * SWEEP_BAR_WIDTH + 0.5) : 0;
+    memset(bar, '#', width);
+    bar[width] = '\0';
+
+    bool cliff = previous > 0 && rate < previous * (1.0 - SWEEP_CLIFF_DROP);
+    printf("%12s %10.2f %10.2f |%-*s|%s\n", value, rate, avg_rate,
+           SWEEP_BAR_WIDTH, bar, cliff ? " <- drop" : "");
+    previous = rate;
+  }
+
+  char value[32];
+  format_sweep_value(range, points[best_index].parameter, value,
+                     sizeof(value));
+  printf("Peak: %.2f GB/s at %s=%s\n", best, range->name, value);
+}
@@ -0,0 +1,160 @@
+#include <cstring>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+// Machine-readable benchmark results, appended to a file so repeated runs
+// accumulate samples. "*.csv" files get one row per sample; anything else
+// gets one JSON object per line. Every record carries the git SHA, host, CPU
+// model and timer frequency so compare_results can line up two sets.
+//
+// Times are stored in raw CPU timer ticks along with timer_hz.
+
+struct ResultMeta {
+  char git_sha[48];
+  char host[128];
+  char cpu_model[128];
+  u64 timer_hz;
+};
+
+struct ResultSink {
+  FILE *file;
+  bool csv;
+  const char *tool;
+  ResultMeta meta;
+};
+
+static void read_command_line(const char *command, char *out, size_t size) {
+  out[0] = '\0';
+  FILE *pipe = popen(command, "r");
+  if (pipe) {
+    if (fgets(out, size, pipe)) {
+      out[strcspn(out, "\n")] = '\0';
+    }
+    pclose(pipe);
+  }
+}
+
+static void collect_result_meta(ResultMeta *meta) {
+  // BENCH_GIT_SHA overrides, for runs outside a checkout.
+  const char *sha = getenv("BENCH_GIT_SHA");
+  if (sha) {
+    snprintf(meta->git_sha, sizeof(meta->git_sha), "%s", sha);
+  } else {
+    read_command_line("git rev-parse --short HEAD 2>/dev/null", meta->git_sha,
+                      sizeof(meta->git_sha));
+  }
+
+  if (gethostname(meta->host, sizeof(meta->host)) != 0) {
+    meta->host[0] = '\0';
+  }
+
+  meta->cpu_model[0] = '\0';
+#if defined(__APPLE__)
+  size_t size = sizeof(meta->cpu_model);
+  sysctlbyname("machdep.cpu.brand_string", meta->cpu_model, &size, nullptr, 0);
+#else
+  read_command_line("grep -m1 'model name' /proc/cpuinfo | cut -d: -f2 | "
+                    "sed 's/^ //'",
+                    meta->cpu_model, sizeof(meta->cpu_model));
+#endif
+
+  meta->timer_hz = get_cpu_timer_frequency();
+}
+
+// Strips characters that would need escaping in either format.
+static void sanitize_field(char *text) {
+  for (; *text; ++text) {
+    if (*text == '"' || *text == '\\' || *text == ',') {
+      *text = ' ';
+    }
+  }
+}
+
+static bool open_results(ResultSink *sink, const char *path, const char *tool) {
+  size_t length = strlen(path);
+  sink->csv = length >= 4 && strcmp(path + length - 4, ".csv") == 0;
+  sink->tool = tool;
+  sink->file = fopen(path, "a");
+  if (!sink->file) {
+    fprintf(stderr, "Can't open results file %s\n", path);
+    return false;
+  }
+
+  collect_result_meta(&sink->meta);
+  sanitize_field(sink->meta.git_sha);
+  sanitize_field(sink->meta.host);
+  sanitize_field(sink->meta.cpu_model);
+
+  if (sink->csv && ftell(sink->file) == 0) {
+    fprintf(sink->file,
+            "tool,name,unit,git,host,cpu,timer_hz,bytes,sample\n");
+  }
+  return true;
+}
+
+// One measurement series. unit is "ticks" for timer samples; other units
+// (e.g. "faults") are compared as plain numbers. Lower is better for all.
+static void write_result(ResultSink *sink, const char *name, const char *unit,
+                         u64 bytes, const u64 *samples, u32 count) {
+  if (!sink->file || count == 0) {
+    return;
+  }
+  ResultMeta *meta = &sink->meta;
+
+  if (sink->csv) {
+    for (u32 i = 0; i < count; ++i) {
+      fprintf(sink->file, "%s,%s,%s,%s,%s,%s,%llu,%llu,%llu\n", sink->tool,
+              name, unit, meta->git_sha, meta->host, meta->cpu_model,
+              (unsigned long long)meta->timer_hz, (unsigned long long)bytes,
+              (unsigned long long)samples[i]);
+    }
+    return;
+  }
+
+  u64 min = samples[0];
+  f64 sum = 0;
+  for (u32 i = 0; i < count; ++i) {
+    min = samples[i] < min ? samples[i] : min;
+    sum += samples[i];
+  }
+  fprintf(sink->file,
+          "{\"tool\": \"%s\", \"name\": \"%s\", \"unit\": \"%s\", "
+          "\"git\": \"%s\", \"host\": \"%s\", \"cpu\": \"%s\", "
+          "\"timer_hz\": %llu, \"bytes\": %llu, \"min\": %llu, "
+          "\"mean\": %.1f, \"samples\": [",
+          sink->tool, name, unit, meta->git_sha, meta->host, meta->cpu_model,
+          (unsigned long long)meta->timer_hz, (unsigned long long)bytes,
+          (unsigned long long)min, sum / count);
+  for (u32 i = 0; i < count; ++i) {
+    fprintf(sink->file, "%s%llu", i ? ", " : "",
+            (unsigned long long)samples[i]);
+  }
+  fprintf(sink->file, "]}\n");
+}
+
+#if PROFILE
+// Every profiler block as a one-sample series (inclusive ticks), plus the
+// whole run. Call after end_profile().
+static inline void write_profile_results(ResultSink *sink) {
+  u64 total = PROFILER.end_time - PROFILER.start_time;
+  write_result(sink, "total", "ticks", 0, &total, 1);
+  for (u32 i = 0; i < TIMING_ARRAY_SIZE; ++i) {
+    TimeInfo *info = &PROFILER.timings[i];
+    if (info->elapsed_total) {
+      write_result(sink, info->label, "ticks", info->byte_count,
+                   &info->elapsed_total, 1);
+    }
+  }
+}
+#endif
+
+static void close_results(ResultSink *sink) {
+  if (sink->file) {
+    fclose(sink->file);
+    sink->file = nullptr;
+  }
+}
@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "repetition_tester.cc"
+#include "results.cc"
+
+// Throughput curves from run_sweep:
+//   cache    read a buffer of 4K..256M over and over; drops are cache levels
+//   chunk    read FILE with pread in chunks of 4K..64M into one chunk buffer
+//   threads  striped read of a 256M buffer by 1..2x the hardware threads
+//
+// Usage: sweep_bandwidth cache|chunk FILE|threads [-repetitions n]
+//                        [-results file.jsonl|file.csv]
+
+#define MAX_BUFFER_SIZE (256ull * 1024 * 1024)
+#define MIN_BYTES_PER_RUN (64ull * 1024 * 1024)
+#define STRIPE_SIZE (4096 * 32)
+
+struct BufferContext {
+  u64 *buffer;
+  size_t size;
+};
+
+static u64 *map_buffer(size_t size) {
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %zu bytes\n", size);
+    exit(1);
+  }
+  return (u64 *)base;
+}
+
+static void touch_prefix(void *context, u64 size) {
+  BufferContext *buffer = (BufferContext *)context;
+  for (size_t i = 0; i < size / sizeof(u64); ++i) {
+    buffer->buffer[i] = i;
+  }
+}
+
+static u64 sum_range(const u64 *values, size_t count) {
+  u64 a = 0, b = 0, c = 0, d = 0;
+  for (size_t i = 0; i + 4 <= count; i += 4) {
+    a += values[i];
+    b += values[i + 1];
+    c += values[i + 2];
+    d += values[i + 3];
+  }
+  return a + b + c + d;
+}
+
+// Small sizes are read several times, so every run moves enough bytes for
+// the timer to resolve.
+static u64 read_prefix(void *context, u64 size) {
+  BufferContext *buffer = (BufferContext *)context;
+  u64 passes = size < MIN_BYTES_PER_RUN ? MIN_BYTES_PER_RUN / size : 1;
+  for (u64 pass = 0; pass < passes; ++pass) {
+    keep_value(sum_range(buffer->buffer, size / sizeof(u64)));
+    clobber_memory();
+  }
+  return passes * size;
+}
+
+struct FileContext {
+  int fd;
+  size_t file_size;
+  char *chunk;
+};
+
+static u64 read_file_chunks(void *context, u64 chunk_size) {
+  FileContext *file = (FileContext *)context;
+  size_t offset = 0;
+  while (offset < file->file_size) {
+    ssize_t got = pread(file->fd, file->chunk, chunk_size, offset);
+    if (got <= 0) {
+      break;
+    }
+    clobber_memory();
+    offset += got;
+  }
+  return offset;
+}
+
+static void sum_stripes(const u64 *base, size_t count, u32 first, u32 stride,
+                        u64 *result) {
+  size_t stripe = STRIPE_SIZE / sizeof(u64);
+  u64 sum = 0;
+  for (size_t start = first * stripe; start < count; start += stride * stripe) {
+    size_t end = start + stripe < count ? start + stripe : count;
+    sum += sum_range(base + start, end - start);
+  }
+  *result = sum;
+}
+
+static u64 read_threaded(void *context, u64 thread_count) {
+  BufferContext *buffer = (BufferContext *)context;
+  size_t count = buffer->size / sizeof(u64);
+  u64 *sums = new u64[thread_count];
+  std::thread *workers = new std::thread[thread_count];
+  for (u32 t = 0; t < thread_count; ++t) {
+    workers[t] = std::thread(sum_stripes, buffer->buffer, count, t,
+                             (u32)thread_count, &sums[t]);
+  }
+  u64 total = 0;
+  for (u32 t = 0; t < thread_count; ++t) {
+    workers[t].join();
+    total += sums[t];
+  }
+  keep_value(total);
+  delete[] workers;
+  delete[] sums;
+  return buffer->size;
+}
+
+static void write_sweep_results(ResultSink *sink, SweepCandidate *candidate,
+                                SweepRange *range, SweepPoint *points,
+                                u32 count) {
+  for (u32 i = 0; i < count; ++i) {
+    char value[32], name[128];
+    format_sweep_value(range, points[i].parameter, value, sizeof(value));
+    snprintf(name, sizeof(name), "%s %s=%s", candidate->name, range->name,
+             value);
+    write_result(sink, name, "ticks", points[i].bytes, points[i].samples,
+                 points[i].sample_count);
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *sweep = nullptr;
+  const char *file_name = nullptr;
+  const char *results_path = nullptr;
+  u32 repetitions = 20;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-repetitions") == 0 && i + 1 < argc) {
+      repetitions = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-results") == 0 && i + 1 < argc) {
+      results_path = argv[++i];
+    } else if (!sweep) {
+      sweep = argv[i];
+    } else {
+      file_name = argv[i];
+    }
+  }
+
+  bool chunk = sweep && strcmp(sweep, "chunk") == 0;
+  if (!sweep || repetitions == 0 || (chunk && !file_name) ||
+      (!chunk && strcmp(sweep, "cache") != 0 &&
+       strcmp(sweep, "threads") != 0)) {
+    printf("Usage: %s cache|chunk FILE|threads [-repetitions n] "
+           "[-results file.jsonl|file.csv]\n",
+           argv[0]);
+    return 1;
+  }
+
+  BufferContext buffer = {};
+  FileContext file = {};
+  SweepCandidate candidate = {};
+  SweepRange range = {};
+  if (strcmp(sweep, "cache") == 0) {
+    buffer.buffer = map_buffer(MAX_BUFFER_SIZE);
+    buffer.size = MAX_BUFFER_SIZE;
+    candidate = {"read buffer", &buffer, touch_prefix, read_prefix};
+    range = {"size", 4096, MAX_BUFFER_SIZE, 2, true, true};
+  } else if (chunk) {
+    file.fd = open(file_name, O_RDONLY);
+    struct stat info;
+    if (file.fd < 0 || fstat(file.fd, &info) != 0) {
+      fprintf(stderr, "Can't open %s\n", file_name);
+      return 1;
+    }
+    file.file_size = info.st_size;
+    range = {"chunk", 4096, 64ull * 1024 * 1024, 2, true, true};
+    file.chunk = (char *)map_buffer(range.last);
+    candidate = {"pread", &file, nullptr, read_file_chunks};
+  } else {
+    buffer.buffer = map_buffer(MAX_BUFFER_SIZE);
+    buffer.size = MAX_BUFFER_SIZE;
+    touch_prefix(&buffer, MAX_BUFFER_SIZE);
+    u32 hardware = std::thread::hardware_concurrency();
+    candidate = {"striped read", &buffer, nullptr, read_threaded};
+    range = {"threads", 1, 2 * (hardware ? hardware : 1), 1, false, false};
+  }
+
+  u32 count = sweep_point_count(&range);
+  if (count == 0) {
+    fprintf(stderr, "Invalid %s range\n", range.name);
+    return 1;
+  }
+  SweepPoint *points = new SweepPoint[count];
+  count = run_sweep(&candidate, &range, repetitions, points);
+  print_sweep(&candidate, &range, points, count);
+
+  if (results_path) {
+    ResultSink sink;
+    if (open_results(&sink, results_path, "sweep_bandwidth")) {
+      write_sweep_results(&sink, &candidate, &range, points, count);
+      close_results(&sink);
+    }
+  }
+  delete[] points;
+}
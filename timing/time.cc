@@ -1,14 +1,27 @@
 #include "stdio.h"
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 typedef double f64;
+typedef float f32;
 typedef uint64_t u64;
 typedef uint32_t u32;
 
+#if defined(__aarch64__)
 inline u64 read_cpu_timer(void) {
   u64 counter;
   asm volatile("mrs %0, CNTVCT_EL0" : "=r"(counter));
@@ -20,6 +33,21 @@ inline u64 get_cpu_timer_frequency(void) {
   asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frequency));
   return frequency;
 }
+#else
+inline u64 read_cpu_timer(void) { return __rdtsc(); }
+
+static u64 calibrate_cpu_timer_frequency(void);
+
+// The TSC rate is not architecturally exposed, so it is calibrated once per
+// process (and cached on disk per host and boot, see below).
+inline u64 get_cpu_timer_frequency(void) {
+  static u64 frequency;
+  if (!frequency) {
+    frequency = calibrate_cpu_timer_frequency();
+  }
+  return frequency;
+}
+#endif
 
 static u64 get_os_timer_frequency(void) { return 1000000; }
 
@@ -64,10 +92,166 @@ static u64 estimate_cpu_frequency(u64 wait_millis) {
   }
 }
 
+#if !defined(__aarch64__)
+// TSC frequency in preference order:
+//   1. the on-disk cache, valid for this host until it reboots;
+//   2. CPUID leaf 0x15 (TSC / crystal ratio), then leaf 0x16 (base MHz),
+//      only when the TSC is invariant;
+//   3. sysfs tsc_freq_khz, where the kernel exports it;
+//   4. a 10ms calibration against CLOCK_MONOTONIC_RAW.
+// Anything but the last takes microseconds.
+
+static u64 cpuid_tsc_frequency(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+      !(edx & (1 << 8))) {
+    return 0; // not invariant, CPUID rates don't describe it
+  }
+  unsigned max_leaf = __get_cpuid_max(0, nullptr);
+  if (max_leaf >= 0x15) {
+    __cpuid(0x15, eax, ebx, ecx, edx);
+    if (eax && ebx && ecx) {
+      return (u64)ecx * ebx / eax;
+    }
+  }
+  if (max_leaf >= 0x16) {
+    __cpuid(0x16, eax, ebx, ecx, edx);
+    if (eax) {
+      return (u64)eax * 1000000;
+    }
+  }
+  return 0;
+}
+
+static u64 sysfs_tsc_frequency(void) {
+  u64 khz = 0;
+  FILE *file = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+  if (file) {
+    if (fscanf(file, "%llu", (unsigned long long *)&khz) != 1) {
+      khz = 0;
+    }
+    fclose(file);
+  }
+  return khz * 1000;
+}
+
+static u64 monotonic_raw_ns(void) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  return (u64)now.tv_sec * 1000000000ull + (u64)now.tv_nsec;
+}
+
+// Reads the clock between two TSC reads and takes the midpoint; retries a
+// few times to keep the tightest bracket, so one interrupt can't skew it.
+static void paired_read(u64 *tsc, u64 *ns) {
+  u64 best_width = ~0ull;
+  for (int i = 0; i < 8; ++i) {
+    u64 before = read_cpu_timer();
+    u64 clock = monotonic_raw_ns();
+    u64 after = read_cpu_timer();
+    if (after - before < best_width) {
+      best_width = after - before;
+      *tsc = before + (after - before) / 2;
+      *ns = clock;
+    }
+  }
+}
+
+static u64 measure_tsc_frequency(u64 wait_ns) {
+  u64 tsc0 = 0, ns0 = 0, tsc1 = 0, ns1 = 0;
+  paired_read(&tsc0, &ns0);
+  do {
+    paired_read(&tsc1, &ns1);
+  } while (ns1 - ns0 < wait_ns);
+  return (u64)((f64)(tsc1 - tsc0) * 1e9 / (f64)(ns1 - ns0));
+}
+
+static void timer_cache_path(char *path, size_t size) {
+  char host[128] = "";
+  gethostname(host, sizeof(host) - 1);
+  char dir[256] = "/tmp";
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache && cache[0]) {
+    snprintf(dir, sizeof(dir), "%s", cache);
+  } else if (home && home[0]) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  }
+  // A fresh account may not have its cache directory yet.
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    strcpy(dir, "/tmp");
+  }
+  snprintf(path, size, "%s/cpu_timer_frequency.%s", dir, host);
+}
+
+static void read_boot_id(char *boot_id, size_t size) {
+  boot_id[0] = '\0';
+  FILE *file = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (file) {
+    if (!fgets(boot_id, size, file)) {
+      boot_id[0] = '\0';
+    }
+    fclose(file);
+  }
+  for (char *c = boot_id; *c; ++c) {
+    if (*c == '\n') {
+      *c = '\0';
+    }
+  }
+}
+
+static u64 calibrate_cpu_timer_frequency(void) {
+  char path[512], boot_id[64];
+  timer_cache_path(path, sizeof(path));
+  read_boot_id(boot_id, sizeof(boot_id));
+
+  FILE *file = fopen(path, "r");
+  if (file) {
+    char cached_boot[64];
+    unsigned long long cached = 0;
+    bool hit = fscanf(file, "%63s %llu", cached_boot, &cached) == 2 &&
+               strcmp(cached_boot, boot_id[0] ? boot_id : "-") == 0;
+    fclose(file);
+    if (hit && cached) {
+      return cached;
+    }
+  }
+
+  u64 frequency = cpuid_tsc_frequency();
+  if (!frequency) {
+    frequency = sysfs_tsc_frequency();
+  }
+  if (!frequency) {
+    frequency = measure_tsc_frequency(10 * 1000000);
+  }
+
+  file = fopen(path, "w");
+  if (file) {
+    fprintf(file, "%s %llu\n", boot_id[0] ? boot_id : "-",
+            (unsigned long long)frequency);
+    fclose(file);
+  }
+  return frequency;
+}
+#endif
+
 #ifndef PROFILE
 #define PROFILE 1
 #endif
 
+// Opt-in: build with -DTRACK_ALLOCATIONS=1 to also attribute heap traffic to
+// the innermost active block and sample page faults / peak RSS around each
+// block. Adds a getrusage call to every block entry and exit.
+#ifndef TRACK_ALLOCATIONS
+#define TRACK_ALLOCATIONS 0
+#endif
+
+// Opt-in: build with -DPROFILE_SNAPSHOTS=1 to be able to dump the timing table
+// while the program runs, on SIGUSR1 or when PROFILE_SNAPSHOT_FILE appears.
+#ifndef PROFILE_SNAPSHOTS
+#define PROFILE_SNAPSHOTS 0
+#endif
+
 #if PROFILE
 
 struct TimeInfo {
@@ -76,6 +260,14 @@ struct TimeInfo {
   u64 hits;
   u64 byte_count;
   const char *label;
+
+  // TRACK_ALLOCATIONS only. Bytes and counts exclude children; peak live
+  // bytes and faults include them.
+  u64 alloc_bytes;
+  u64 alloc_count;
+  u64 peak_live_bytes;
+  u64 page_faults;
+  u64 resident_bytes; // resident set size when the block last exited
 };
 
 #define TIMING_ARRAY_SIZE 4096
@@ -91,31 +283,264 @@ static Profiler PROFILER;
 
 static u32 global_parent_index;
 
+#if PROFILE_SNAPSHOTS
+#include <atomic>
+#include <signal.h>
+#include <thread>
+#include <unistd.h>
+
+// One seqlock per timing entry. The block that owns the entry bumps its
+// sequence to odd, updates, and bumps it back to even; the snapshot thread
+// copies the entry and retries if the sequence was odd or moved. The hot path
+// never waits on the reader.
+static std::atomic<u32> timing_sequence[TIMING_ARRAY_SIZE];
+
+static inline void begin_timing_write(u32 index) {
+  timing_sequence[index].store(
+      timing_sequence[index].load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline void end_timing_write(u32 index) {
+  timing_sequence[index].store(
+      timing_sequence[index].load(std::memory_order_relaxed) + 1,
+      std::memory_order_release);
+}
+#else
+#define begin_timing_write(...)
+#define end_timing_write(...)
+#endif
+
+#if TRACK_ALLOCATIONS
+#include <fcntl.h>
+#include <malloc.h>
+#include <new>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <malloc/malloc.h>
+#define allocation_size malloc_size
+#else
+#define allocation_size malloc_usable_size
+#endif
+
+// Heap state shared by the hooks below. Like the rest of the profiler this
+// is not synchronized; allocations on other threads land on whatever block
+// the main thread has open.
+struct AllocationTracker {
+  u64 live_bytes;
+  u64 scope_peak; // highest live_bytes since the innermost block opened
+};
+
+static AllocationTracker ALLOCATIONS;
+
+// Also called directly for memory that doesn't come from malloc, such as
+// mmap'd buffers.
+static inline void record_allocated_bytes(u64 size) {
+  TimeInfo *info = &PROFILER.timings[global_parent_index];
+  info->alloc_bytes += size;
+  info->alloc_count++;
+  ALLOCATIONS.live_bytes += size;
+  if (ALLOCATIONS.live_bytes > ALLOCATIONS.scope_peak) {
+    ALLOCATIONS.scope_peak = ALLOCATIONS.live_bytes;
+  }
+}
+
+static inline void record_freed_bytes(u64 size) {
+  ALLOCATIONS.live_bytes -= size;
+}
+
+static void record_allocation(void *pointer) {
+  if (pointer) {
+    record_allocated_bytes(allocation_size(pointer));
+  }
+}
+
+static void record_free(void *pointer) {
+  if (pointer) {
+    record_freed_bytes(allocation_size(pointer));
+  }
+}
+
+static u64 read_page_faults() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+// Current resident set size. ru_maxrss would only give the process peak.
+static u64 read_resident_bytes() {
+#if defined(__APPLE__)
+  mach_task_basic_info info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+                &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return info.resident_size;
+#else
+  // statm is in pages: total size, then resident. Read with a plain fd so
+  // the sample doesn't show up as a heap allocation of the block.
+  char text[128];
+  int fd = open("/proc/self/statm", O_RDONLY);
+  ssize_t length = fd >= 0 ? read(fd, text, sizeof(text) - 1) : -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+  unsigned long long size = 0, pages = 0;
+  if (length > 0) {
+    text[length] = 0;
+    if (sscanf(text, "%llu %llu", &size, &pages) != 2) {
+      pages = 0;
+    }
+  }
+  return (u64)pages * (u64)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+#if defined(__GLIBC__)
+// glibc lets malloc and friends be replaced outright, which also catches
+// operator new (it calls malloc) and C code.
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void *__libc_memalign(size_t, size_t);
+extern "C" void __libc_free(void *);
+
+extern "C" void *malloc(size_t size) {
+  void *pointer = __libc_malloc(size);
+  record_allocation(pointer);
+  return pointer;
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  void *pointer = __libc_calloc(count, size);
+  record_allocation(pointer);
+  return pointer;
+}
+
+// A failed realloc leaves the old block alone, so it is only counted once
+// the call succeeds. realloc(p, 0) may free p and return NULL.
+extern "C" void *realloc(void *old, size_t size) {
+  u64 old_size = old ? allocation_size(old) : 0;
+  void *pointer = __libc_realloc(old, size);
+  if (pointer || (old && size == 0)) {
+    record_freed_bytes(old_size);
+    record_allocation(pointer);
+  }
+  return pointer;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size) {
+  void *pointer = __libc_memalign(alignment, size);
+  record_allocation(pointer);
+  return pointer;
+}
+
+extern "C" int posix_memalign(void **out, size_t alignment, size_t size) {
+  *out = __libc_memalign(alignment, size);
+  record_allocation(*out);
+  return *out ? 0 : 12; // ENOMEM
+}
+
+extern "C" void free(void *pointer) {
+  record_free(pointer);
+  __libc_free(pointer);
+}
+
+void *operator new(size_t size) {
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept { free(pointer); }
+
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+#else
+// Elsewhere only C++ allocations are visible.
+void *operator new(size_t size) {
+  void *pointer = malloc(size ? size : 1);
+  if (!pointer) {
+    throw std::bad_alloc();
+  }
+  record_allocation(pointer);
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+  record_free(pointer);
+  free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+  record_free(pointer);
+  free(pointer);
+}
+#endif
+#endif
+
 struct TraceBlock {
   u64 t0;
   const char *block_name;
   u32 index;
   u32 parent_index;
   u64 elapsed_time_prev;
+#if TRACK_ALLOCATIONS
+  u64 live_at_entry;
+  u64 parent_scope_peak;
+  u64 faults_at_entry;
+#endif
 
   TraceBlock(const char *name, u32 index, u64 byte_count)
       : block_name(name), index(index), parent_index(global_parent_index) {
+#if TRACK_ALLOCATIONS
+    faults_at_entry = read_page_faults();
+    live_at_entry = ALLOCATIONS.live_bytes;
+    parent_scope_peak = ALLOCATIONS.scope_peak;
+    ALLOCATIONS.scope_peak = ALLOCATIONS.live_bytes;
+#endif
     t0 = read_cpu_timer();
     global_parent_index = index;
     elapsed_time_prev = PROFILER.timings[index].elapsed_total;
     PROFILER.timings[index].byte_count = byte_count;
+    PROFILER.timings[index].label = name;
   }
 
   ~TraceBlock() {
     u64 t1 = read_cpu_timer();
+#if TRACK_ALLOCATIONS
+    {
+      TimeInfo *info = &PROFILER.timings[index];
+      info->page_faults += read_page_faults() - faults_at_entry;
+      info->resident_bytes = read_resident_bytes();
+
+      u64 peak = ALLOCATIONS.scope_peak > live_at_entry
+                     ? ALLOCATIONS.scope_peak - live_at_entry
+                     : 0;
+      if (peak > info->peak_live_bytes) {
+        info->peak_live_bytes = peak;
+      }
+      if (ALLOCATIONS.scope_peak > parent_scope_peak) {
+        parent_scope_peak = ALLOCATIONS.scope_peak;
+      }
+      ALLOCATIONS.scope_peak = parent_scope_peak;
+    }
+#endif
 
     TimeInfo *time_info = &PROFILER.timings[index];
     TimeInfo *parent_time_info = &PROFILER.timings[parent_index];
+    begin_timing_write(index);
     time_info->elapsed_wo_child += t1 - t0;
-    parent_time_info->elapsed_wo_child -= t1 - t0;
     time_info->elapsed_total = elapsed_time_prev + t1 - t0;
     time_info->hits++;
-    time_info->label = block_name;
+    end_timing_write(index);
+
+    begin_timing_write(parent_index);
+    parent_time_info->elapsed_wo_child -= t1 - t0;
+    end_timing_write(parent_index);
 
     global_parent_index = parent_index;
     // u64 freq = get_cpu_timer_frequency();
@@ -129,6 +554,40 @@ struct TraceBlock {
 #define TRACE_BLOCK(name) TRACE_BANDWIDTH(name, 0)
 #define TRACE_FUNC TRACE_BLOCK(__func__)
 
+// Time measured somewhere the block macros can't reach, such as a worker
+// thread, added as its own entry. It overlaps with whatever the main thread
+// was doing, so percentages across entries no longer add up to 100.
+static void record_external_time(const char *name, u32 index, u64 elapsed,
+                                 u64 byte_count) {
+  TimeInfo *info = &PROFILER.timings[index];
+  begin_timing_write(index);
+  info->elapsed_wo_child += elapsed;
+  info->elapsed_total += elapsed;
+  info->hits++;
+  end_timing_write(index);
+  info->byte_count = byte_count;
+  info->label = name;
+}
+
+#define TRACE_EXTERNAL(name, elapsed, byte_count)                              \
+  record_external_time(name, __COUNTER__ + 1, elapsed, byte_count);
+
+#if TRACK_ALLOCATIONS
+#define PRINT_ALLOCATIONS(info)                                                \
+  {                                                                            \
+    f64 kilobytes = 1024.;                                                     \
+    printf(" | alloc %.1fkb in %llu, peak live %.1fkb, %llu faults, "          \
+           "rss %.1fmb",                                                       \
+           (f64)(info)->alloc_bytes / kilobytes,                               \
+           (unsigned long long)(info)->alloc_count,                            \
+           (f64)(info)->peak_live_bytes / kilobytes,                           \
+           (unsigned long long)(info)->page_faults,                            \
+           (f64)(info)->resident_bytes / (kilobytes * kilobytes));             \
+  }
+#else
+#define PRINT_ALLOCATIONS(info)
+#endif
+
 #define PRINT_TIMINGS(total_elapsed, freq)                                     \
   {                                                                            \
     for (u32 i = 0; i < TIMING_ARRAY_SIZE; ++i) {                              \
@@ -151,11 +610,108 @@ struct TraceBlock {
                  (f64)info->byte_count / gigabytes /                           \
                      ((f64)info->elapsed_total / freq));                       \
         }                                                                      \
+        PRINT_ALLOCATIONS(info);                                               \
         printf("\n");                                                          \
       }                                                                        \
     }                                                                          \
   }
 
+#if PROFILE_SNAPSHOTS
+static volatile sig_atomic_t snapshot_requested;
+static TimeInfo last_snapshot[TIMING_ARRAY_SIZE];
+static u64 last_snapshot_time;
+static u32 snapshot_count;
+static f64 trace_block_overhead; // ticks per TRACE_BLOCK open + close
+
+static void request_snapshot(int) { snapshot_requested = 1; }
+
+static void read_timing(u32 index, TimeInfo *out) {
+  for (;;) {
+    u32 before = timing_sequence[index].load(std::memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    *out = PROFILER.timings[index];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (timing_sequence[index].load(std::memory_order_relaxed) == before) {
+      return;
+    }
+  }
+}
+
+// Each entry is consistent on its own; entries are read one after another,
+// so a parent's exclusive time can be off by a block closing mid-snapshot.
+// Blocks only report on close, so time inside a block that is still open
+// shows up under the open block line rather than in the table.
+static void write_profile_snapshot(FILE *out) {
+  u64 now = read_cpu_timer();
+  f64 freq = (f64)get_cpu_timer_frequency();
+  u64 interval = now - last_snapshot_time;
+  u32 open_index = __atomic_load_n(&global_parent_index, __ATOMIC_RELAXED);
+
+  fprintf(out,
+          "--- profile snapshot %u at %.4fs (+%.4fs), open block: %s, "
+          "%.1f ticks per block ---\n",
+          ++snapshot_count, (f64)(now - PROFILER.start_time) / freq,
+          (f64)interval / freq,
+          open_index ? PROFILER.timings[open_index].label : "none",
+          trace_block_overhead);
+
+  for (u32 i = 1; i < TIMING_ARRAY_SIZE; ++i) {
+    TimeInfo info;
+    read_timing(i, &info);
+    if (!info.hits) {
+      continue;
+    }
+    TimeInfo *last = &last_snapshot[i];
+    u64 delta = info.elapsed_total - last->elapsed_total;
+    fprintf(out, "%s[%llu +%llu]: %llu (+%llu, %.2f%% of interval)\n",
+            info.label, (unsigned long long)info.hits,
+            (unsigned long long)(info.hits - last->hits),
+            (unsigned long long)info.elapsed_total, (unsigned long long)delta,
+            interval ? 100.0 * (f64)delta / (f64)interval : 0.0);
+    *last = info;
+  }
+  fflush(out);
+  last_snapshot_time = now;
+}
+
+static void snapshot_loop(const char *control_file) {
+  for (;;) {
+    usleep(50 * 1000);
+    bool control = control_file && access(control_file, F_OK) == 0;
+    if (control) {
+      unlink(control_file);
+    }
+    if (snapshot_requested || control) {
+      snapshot_requested = 0;
+      write_profile_snapshot(stderr);
+    }
+  }
+}
+
+// Times empty blocks on the last, otherwise unused, entry and clears it.
+// Runs before the profile's start time is taken, so it stays out of the
+// totals; a few thousand blocks are enough for a per-block average.
+static void measure_trace_overhead() {
+  const u32 runs = 10000;
+  u32 index = TIMING_ARRAY_SIZE - 1;
+  u64 start = read_cpu_timer();
+  for (u32 i = 0; i < runs; ++i) {
+    TraceBlock block("overhead", index, 0);
+  }
+  trace_block_overhead = (f64)(read_cpu_timer() - start) / runs;
+  PROFILER.timings[0] = {};
+  PROFILER.timings[index] = {};
+}
+
+static void start_profile_snapshots() {
+  last_snapshot_time = PROFILER.start_time;
+  signal(SIGUSR1, request_snapshot);
+  std::thread(snapshot_loop, getenv("PROFILE_SNAPSHOT_FILE")).detach();
+}
+#endif
+
 #else
 
 struct Profiler {
@@ -168,12 +724,21 @@ static Profiler PROFILER;
 
 #define TRACE_BANDWIDTH(...)
 #define TRACE_BLOCK(...)
+#define TRACE_EXTERNAL(...)
 #define PRINT_TIMINGS(...)
 #define TRACE_FUNC
 
 #endif
 
-static void begin_profile() { PROFILER.start_time = read_cpu_timer(); }
+static void begin_profile() {
+#if PROFILE && PROFILE_SNAPSHOTS
+  measure_trace_overhead();
+#endif
+  PROFILER.start_time = read_cpu_timer();
+#if PROFILE && PROFILE_SNAPSHOTS
+  start_profile_snapshots();
+#endif
+}
 
 static void end_profile() {
   PROFILER.end_time = read_cpu_timer();
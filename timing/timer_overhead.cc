@@ -0,0 +1,253 @@
+#include <atomic>
+#include <thread>
+
+#include "repetition_tester.cc"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+// Characterizes every clock source we could use for TraceBlock: cost per
+// call (from the repetition tester, batches of calls timed with the CPU
+// timer), smallest step it can report, and whether consecutive reads ever go
+// backwards. Finishes with a cross-core check of the CPU timer itself.
+
+#define CALLS_PER_BATCH 1000
+#define RESOLUTION_SAMPLES 2000
+#define MONOTONIC_READS 1000000
+
+struct ClockSource {
+  const char *name;
+  u64 (*read)(void);
+  f64 ns_per_unit; // 0 means CPU timer ticks, filled in at startup
+  bool wall_clock; // can be stepped by NTP or settimeofday
+};
+
+static u64 read_cycle_counter(void) { return read_cpu_timer(); }
+
+#if defined(__x86_64__) || defined(__i386__)
+static u64 read_rdtscp(void) {
+  unsigned aux;
+  return __rdtscp(&aux);
+}
+#endif
+
+template <clockid_t ID> static u64 read_clock(void) {
+  timespec now;
+  clock_gettime(ID, &now);
+  return (u64)now.tv_sec * 1000000000ull + (u64)now.tv_nsec;
+}
+
+static u64 read_gettimeofday(void) { return read_os_timer(); }
+
+#if defined(__APPLE__)
+static u64 read_mach_absolute_time(void) { return mach_absolute_time(); }
+#endif
+
+static ClockSource clock_sources[] = {
+    {"cpu timer", read_cycle_counter, 0, false},
+#if defined(__x86_64__) || defined(__i386__)
+    {"rdtscp", read_rdtscp, 0, false},
+#endif
+    {"CLOCK_REALTIME", read_clock<CLOCK_REALTIME>, 1, true},
+    {"CLOCK_MONOTONIC", read_clock<CLOCK_MONOTONIC>, 1, false},
+    {"CLOCK_MONOTONIC_RAW", read_clock<CLOCK_MONOTONIC_RAW>, 1, false},
+#if defined(CLOCK_MONOTONIC_COARSE)
+    {"CLOCK_MONOTONIC_COARSE", read_clock<CLOCK_MONOTONIC_COARSE>, 1, false},
+#endif
+#if defined(CLOCK_BOOTTIME)
+    {"CLOCK_BOOTTIME", read_clock<CLOCK_BOOTTIME>, 1, false},
+#endif
+#if defined(CLOCK_UPTIME_RAW)
+    {"CLOCK_UPTIME_RAW", read_clock<CLOCK_UPTIME_RAW>, 1, false},
+#endif
+    {"CLOCK_PROCESS_CPUTIME_ID", read_clock<CLOCK_PROCESS_CPUTIME_ID>, 1,
+     false},
+    {"CLOCK_THREAD_CPUTIME_ID", read_clock<CLOCK_THREAD_CPUTIME_ID>, 1, false},
+    {"gettimeofday", read_gettimeofday, 1000, true},
+#if defined(__APPLE__)
+    {"mach_absolute_time", read_mach_absolute_time, 0, false},
+#endif
+};
+
+struct ClockReport {
+  f64 overhead_ns;
+  f64 resolution_ns;
+  u64 backwards;
+};
+
+static ClockReport characterize(ClockSource *source, u32 repetitions) {
+  ClockReport report = {};
+  f64 timer_ns = 1e9 / (f64)get_cpu_timer_frequency();
+
+  static RepetitionTester tester;
+  init_tester(&tester, repetitions);
+  tester.quiet = true;
+  volatile u64 sink = 0;
+  while (is_testing(&tester)) {
+    begin_time(&tester);
+    for (u32 i = 0; i < CALLS_PER_BATCH; ++i) {
+      sink += source->read();
+    }
+    end_time(&tester);
+  }
+  report.overhead_ns = (f64)tester.min_time * timer_ns / CALLS_PER_BATCH;
+
+  // Smallest non-zero step between back-to-back distinct readings.
+  u64 smallest = ~0ull;
+  for (u32 i = 0; i < RESOLUTION_SAMPLES; ++i) {
+    u64 first = source->read();
+    u64 next = first;
+    for (u32 spins = 0; next == first && spins < 100000000; ++spins) {
+      next = source->read();
+    }
+    if (next > first && next - first < smallest) {
+      smallest = next - first;
+    }
+  }
+  report.resolution_ns = smallest * source->ns_per_unit;
+
+  u64 previous = source->read();
+  for (u32 i = 0; i < MONOTONIC_READS; ++i) {
+    u64 value = source->read();
+    report.backwards += value < previous;
+    previous = value;
+  }
+  return report;
+}
+
+#if defined(__linux__)
+static bool pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Ping-pong between two pinned threads. Each side publishes its timer value
+// and the other reads its own timer after seeing it, so a consistent counter
+// always gives a positive difference. The minimum over many round trips is
+// the one-way latency plus the offset between the cores; a negative minimum
+// means the counters disagree.
+static std::atomic<u64> pingpong_value;
+static std::atomic<u32> pingpong_turn;
+
+// The exchange runs even if pinning failed, so the other side isn't left
+// waiting; *pinned says whether the result means anything.
+static void pingpong_side(int cpu, u32 me, u32 rounds, int64_t *min_delta,
+                          bool *pinned) {
+  *pinned = pin_to_cpu(cpu);
+  int64_t best = INT64_MAX;
+  for (u32 round = 0; round < rounds; ++round) {
+    while (pingpong_turn.load(std::memory_order_acquire) != me) {
+    }
+    u64 now = read_cpu_timer();
+    if (round || me) {
+      int64_t delta = (int64_t)(now - pingpong_value.load());
+      best = delta < best ? delta : best;
+    }
+    pingpong_value.store(read_cpu_timer());
+    pingpong_turn.store(1 - me, std::memory_order_release);
+  }
+  *min_delta = best;
+}
+
+static void check_cross_core(int cpu_a, int cpu_b) {
+  const u32 rounds = 100000;
+  int64_t a_after_b = 0, b_after_a = 0;
+  bool a_pinned = false, b_pinned = false;
+  pingpong_turn.store(0);
+  std::thread other(pingpong_side, cpu_b, 1, rounds, &b_after_a, &b_pinned);
+  pingpong_side(cpu_a, 0, rounds, &a_after_b, &a_pinned);
+  other.join();
+  if (!a_pinned || !b_pinned) {
+    printf("cpu %d <-> cpu %d: skipped, can't pin to cpu %d\n", cpu_a, cpu_b,
+           a_pinned ? cpu_b : cpu_a);
+    return;
+  }
+
+  f64 timer_ns = 1e9 / (f64)get_cpu_timer_frequency();
+  printf("cpu %d <-> cpu %d: min delta %lld / %lld ticks (%.1f / %.1f ns)%s\n",
+         cpu_a, cpu_b, (long long)b_after_a, (long long)a_after_b,
+         b_after_a * timer_ns, a_after_b * timer_ns,
+         b_after_a < 0 || a_after_b < 0 ? "  INCONSISTENT" : "");
+}
+#endif
+
+int main(int argc, char **argv) {
+  u32 repetitions = argc > 1 ? atoi(argv[1]) : 200;
+  if (repetitions == 0) {
+    printf("Usage: %s [num_repetitions]\n", argv[0]);
+    return 1;
+  }
+
+  f64 timer_ns = 1e9 / (f64)get_cpu_timer_frequency();
+#if defined(__APPLE__)
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+#endif
+  for (ClockSource &source : clock_sources) {
+    if (source.ns_per_unit == 0) {
+      source.ns_per_unit = timer_ns;
+    }
+#if defined(__APPLE__)
+    if (source.read == read_mach_absolute_time) {
+      source.ns_per_unit = (f64)timebase.numer / timebase.denom;
+    }
+#endif
+  }
+
+  printf("CPU timer: %llu Hz (%.3f ns/tick)\n",
+         (unsigned long long)get_cpu_timer_frequency(), timer_ns);
+  printf("%-26s %12s %14s %10s\n", "source", "ns/call", "resolution ns",
+         "backwards");
+
+  const char *cheapest = nullptr;
+  f64 cheapest_cost = 0;
+  for (ClockSource &source : clock_sources) {
+    ClockReport report = characterize(&source, repetitions);
+    printf("%-26s %12.2f %14.2f %10llu\n", source.name, report.overhead_ns,
+           report.resolution_ns, (unsigned long long)report.backwards);
+
+    // Usable for TraceBlock: not a wall clock, never seen going backwards,
+    // and fine enough to see a block a few hundred cycles long.
+    bool usable = !source.wall_clock && report.backwards == 0 &&
+                  report.resolution_ns <= 100;
+    if (usable && (!cheapest || report.overhead_ns < cheapest_cost)) {
+      cheapest = source.name;
+      cheapest_cost = report.overhead_ns;
+    }
+  }
+  if (cheapest) {
+    printf("Cheapest monotonic source with <=100ns resolution: %s (%.2f ns)\n",
+           cheapest, cheapest_cost);
+  }
+
+#if defined(__linux__)
+  // Only CPUs we're allowed to run on (taskset, cgroups), which needn't
+  // start at 0 or be contiguous. Read before pinning narrows the mask.
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    printf("Cross-core check skipped: can't read the CPU affinity mask\n");
+    return 0;
+  }
+  int first_cpu = -1;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    if (first_cpu < 0) {
+      first_cpu = cpu;
+    } else {
+      check_cross_core(first_cpu, cpu);
+    }
+  }
+  if (CPU_COUNT(&allowed) < 2) {
+    printf("Cross-core check skipped: only one CPU available\n");
+  }
+#endif
+}